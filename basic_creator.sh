@@ -32,18 +32,10 @@ if [ ! -e ${MOM} ]; then
 	error "no ${MOM}"
 fi
 BUNDLE_LIST=$(cat ${MOM} | awk -v V=${VER} '$1 ~ /^M\./ && $3 == V { print $4 }')
-for BUNDLE in $BUNDLE_LIST; do
-	#background them for parallelization
-	${SWUPDREPO}/swupd_make_pack --statedir ${UPDATEDIR} 0 ${VER} ${BUNDLE} &
-done
-#now await all completing
-for job in $(jobs -p); do
-	wait ${job}
-	RET=$?
-	if [ "$RET" != "0" ]; then
-		error "zero pack subprocessor failed"
-	fi
-done
+# all bundles in one process, so they share one thread pool and the deltas
+if [ -n "${BUNDLE_LIST}" ]; then
+	${SWUPDREPO}/swupd_make_packs --statedir ${UPDATEDIR} ${VER} ${BUNDLE_LIST} || error "zero pack creation failed"
+fi
 
 # expose the new build to staging / testing
 echo ${VER} > ${UPDATEDIR}/image/LAST_VER
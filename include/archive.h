@@ -0,0 +1,235 @@
+#ifndef __INCLUDE_GUARD_ARCHIVE_H
+#define __INCLUDE_GUARD_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* zstd dictionaries are trained on, and used for, files up to this size */
+#define DICTIONARY_FILE_MAX (64 * 1024)
+#define DICTIONARY_SIZE (110 * 1024)
+
+enum compression_type {
+	COMPRESSION_GZIP,
+	COMPRESSION_XZ,
+	COMPRESSION_BZIP2,
+	COMPRESSION_ZSTD,
+	COMPRESSION_TYPES
+};
+
+enum file_class {
+	FILE_CLASS_DATA,
+	FILE_CLASS_ELF,
+	FILE_CLASS_TEXT,
+	FILE_CLASS_COMPRESSED,
+	FILE_CLASS_SMALL,
+	FILE_CLASS_TYPES
+};
+
+struct compressor;
+
+/* The compressions to produce for one fullfile */
+struct compression_choice {
+	enum file_class class;
+	enum compression_type predicted; /* expected to be the smallest, or
+					  * COMPRESSION_TYPES when the sizes
+					  * are simply compared */
+	int count;			 /* entries used in "types" */
+	enum compression_type types[COMPRESSION_TYPES];
+};
+
+/*
+ * Get the file name suffix used for a compression type.
+ *
+ * @param type - The compression type.
+ * @return - A static string such as ".gz".
+ */
+const char *compression_suffix(enum compression_type type);
+
+/*
+ * Check whether support for a compression type was compiled in.
+ *
+ * @param type - The compression type.
+ * @return - true if compressor_open() can produce this type.
+ */
+bool compression_available(enum compression_type type);
+
+/*
+ * Check whether a compression type may be used for content of the given
+ * format. zstd additionally needs the [Server] zstdformat setting.
+ *
+ * @param type - The compression type.
+ * @param format - The format of the release being produced.
+ * @return - true if the type is available and allowed.
+ */
+bool compression_enabled(enum compression_type type, unsigned long long format);
+
+/*
+ * Create a file holding a compressed stream. The stream uses the same
+ * container and default level as the matching tar -z/-J/-j option.
+ *
+ * @param type - The compression to use.
+ * @param filename - The output file, created or truncated. If NULL the
+ *                   compressed stream is only measured, not stored.
+ * @return - The new compressor, or NULL on failure.
+ */
+struct compressor *compressor_open(enum compression_type type, const char *filename);
+
+/*
+ * Like compressor_open(), but let the xz encoder use several threads. The
+ * input is then split into independently compressed blocks, which still
+ * form a standard .xz stream. Other types ignore "threads".
+ *
+ * @param type - The compression to use.
+ * @param filename - The output file, or NULL to only measure.
+ * @param threads - The number of encoder threads.
+ * @return - The new compressor, or NULL on failure.
+ */
+struct compressor *compressor_open_threads(enum compression_type type, const char *filename, int threads);
+
+/*
+ * Tell the compressor how much input to expect. Must be called before the
+ * first compressor_write(). zstd uses it to enable long distance matching
+ * for large inputs and the dictionary for small ones, single-threaded xz to
+ * shrink its dictionary to the input; other types ignore it.
+ *
+ * @param comp - The compressor.
+ * @param size - The expected input size in bytes.
+ */
+void compressor_size_hint(struct compressor *comp, uint64_t size);
+
+/*
+ * Train a zstd dictionary from a set of sample files.
+ *
+ * @param dict - Receives the dictionary.
+ * @param capacity - The size of "dict", at most DICTIONARY_SIZE is useful.
+ * @param samples - The sample contents, concatenated.
+ * @param sizes - The size of each sample.
+ * @param count - The number of samples.
+ * @return - The dictionary size, or 0 if no dictionary could be trained.
+ */
+size_t compression_train_dictionary(void *dict, size_t capacity, const void *samples,
+				    const size_t *sizes, unsigned int count);
+
+/*
+ * Use a zstd dictionary for all later zstd compressions of inputs up to
+ * DICTIONARY_FILE_MAX bytes (see compressor_size_hint()). Decompressing
+ * them needs the same dictionary.
+ *
+ * @param dict - The dictionary contents.
+ * @param len - The dictionary size.
+ * @return - true if the dictionary is in use.
+ */
+bool compression_use_dictionary(const void *dict, size_t len);
+
+/*
+ * Check whether a zstd dictionary is in use.
+ *
+ * @return - true after a successful compression_use_dictionary().
+ */
+bool compression_have_dictionary(void);
+
+/*
+ * Identify the zstd dictionary in use. Compressed frames carry the id of
+ * the dictionary they need.
+ *
+ * @return - The id from the dictionary header, 0 when no dictionary is in
+ * use.
+ */
+unsigned int compression_dictionary_id(void);
+
+/*
+ * Stop using the zstd dictionary and free it.
+ */
+void compression_free_dictionary(void);
+
+/*
+ * Estimate the memory a compressor needs while it runs.
+ *
+ * @param type - The compression type.
+ * @param threads - The number of encoder threads, as for
+ *                  compressor_open_threads().
+ * @param size - The expected input size, as for compressor_size_hint().
+ * @return - The estimate in bytes.
+ */
+uint64_t compressor_memusage(enum compression_type type, int threads, uint64_t size);
+
+/*
+ * Compress data into the stream.
+ *
+ * @param comp - The compressor.
+ * @param data - The uncompressed input.
+ * @param len - The input length.
+ * @return - 0 on success, -1 on failure.
+ */
+int compressor_write(struct compressor *comp, const void *data, size_t len);
+
+/*
+ * Finish the stream, close the output file and free the compressor.
+ *
+ * @param comp - The compressor.
+ * @param size - If not NULL, the final size of the compressed file.
+ * @return - 0 on success, -1 on failure.
+ */
+int compressor_close(struct compressor *comp, uint64_t *size);
+
+/*
+ * Write a tar archive holding a single filesystem entry to a set of
+ * compressors. The entry is read once and stored under "name" with its
+ * permissions, ownership, mtime and extended attributes, like
+ * tar TAR_PERM_ATTR_ARGS would store it.
+ *
+ * @param path - The file, directory or symlink to archive.
+ * @param name - The member name to store in the archive.
+ * @param out - The compressors receiving the archive.
+ * @param count - The number of compressors in "out".
+ * @return - 0 on success, -1 on failure.
+ */
+int tar_write_member(const char *path, const char *name, struct compressor **out, int count);
+
+/*
+ * Get a printable name for a file class.
+ *
+ * @param class - The file class.
+ * @return - A static string such as "elf".
+ */
+const char *file_class_name(enum file_class class);
+
+/*
+ * Check whether data starts like a compressed stream or a format with
+ * compressed content (e.g. png, zip, squashfs).
+ *
+ * @param data - The data, or at least its first bytes.
+ * @param len - The length of "data".
+ * @return - true if the data is known to be compressed.
+ */
+bool data_is_compressed(const void *data, size_t len);
+
+/*
+ * Classify a file by its size and leading bytes, as done for the
+ * compression choice.
+ *
+ * @param path - The file to classify.
+ * @return - The file class; FILE_CLASS_SMALL for files shorter than 512
+ * bytes and for files that cannot be read.
+ */
+enum file_class classify_file(const char *path);
+
+/*
+ * Decide which compressions are worth producing for a fullfile. The choice
+ * is predicted from the file size, its type as detected from the leading
+ * bytes, and a trial compression of three samples of up to 64 KiB; files
+ * no larger than the samples select every type instead. Only the
+ * predicted winner is selected, or the top two when their estimates are
+ * within a few percent. Every Nth trial (see the [Fullfiles]
+ * compressionaudit setting) selects all types so the prediction accuracy
+ * can be measured.
+ *
+ * @param path - The file to be archived.
+ * @param format - The format of the release, see compression_enabled().
+ * @param choice - Filled in with the selected compressions, ordered by
+ *                 preference for ties.
+ */
+void compression_choose(const char *path, unsigned long long format, struct compression_choice *choice);
+
+#endif /* __INCLUDE_GUARD_ARCHIVE_H */
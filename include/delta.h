@@ -0,0 +1,113 @@
+#ifndef __INCLUDE_GUARD_DELTA_H
+#define __INCLUDE_GUARD_DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct update_stat;
+
+/* Result of delta_engine.make() when the delta would not be smaller than
+ * the new file, so the fullfile has to be used */
+#define DELTA_TOO_LARGE 1
+
+/*
+ * A way of expressing one file as the difference to another. Every engine
+ * writes a self-identifying stream, so the file names of deltas do not
+ * change and a client tells the engines apart by the leading magic:
+ *   bsdiff - the header of the bsdiff library;
+ *   zstd   - a zstd frame (28 b5 2f fd) using the old file as prefix;
+ *   xdelta - a VCDIFF (RFC 3284) stream (d6 c3 c4) made by xdelta3;
+ *   metadata - "SWUPD-METADATA\t1" and lines with the new "mode:" (octal),
+ *            "uid:" and "gid:", followed by one "xattr:\t<name>\t<length>"
+ *            line, the value and a newline per extended attribute. The
+ *            content is that of the old file.
+ */
+struct delta_engine {
+	const char *name;
+
+	/*
+	 * Check whether the engine can be used on this system.
+	 *
+	 * @return - true if make() and apply() are expected to work.
+	 */
+	bool (*available)(void);
+
+	/*
+	 * Create a delta turning one file into another.
+	 *
+	 * @param original - The old file.
+	 * @param newfile - The new file.
+	 * @param delta - The delta file to create or truncate.
+	 * @return - 0 on success, DELTA_TOO_LARGE if the delta is not smaller
+	 * than the new file, or a negative value on failure.
+	 */
+	int (*make)(char *original, char *newfile, char *delta);
+
+	/*
+	 * Recreate the new file from the old file and a delta made by make().
+	 *
+	 * @param original - The old file.
+	 * @param newfile - The file to create or truncate.
+	 * @param delta - The delta file.
+	 * @return - 0 on success, a non-zero value on failure.
+	 */
+	int (*apply)(char *original, char *newfile, char *delta);
+
+	/*
+	 * Estimate the peak memory use of make(), for the admission control.
+	 *
+	 * @param old_size - The size of the old file.
+	 * @param new_size - The size of the new file.
+	 * @return - The estimate in bytes.
+	 */
+	uint64_t (*memory)(uint64_t old_size, uint64_t new_size);
+};
+
+/*
+ * Set the format of the release the deltas are made for. Engines other
+ * than bsdiff are only used for formats at or above the [Delta]
+ * engineformat setting, as older clients only know bsdiff.
+ *
+ * @param format - The format of the release being produced.
+ */
+void delta_engine_set_format(unsigned long long format);
+
+/*
+ * Look up an engine by name.
+ *
+ * @param name - The engine name, e.g. "bsdiff".
+ * @return - The engine, or NULL if there is no such engine.
+ */
+const struct delta_engine *delta_engine_find(const char *name);
+
+/*
+ * Choose the engine for a pair of files. When only the metadata changed,
+ * this is the metadata record. Otherwise files of at least the [Delta]
+ * largesize setting use the largeengine setting; others the
+ * <class>engine setting for their file class (e.g. compressedengine,
+ * elfengine), falling back to the engine setting. bsdiff is used when
+ * nothing is configured, or when the configured engine is unknown,
+ * unavailable or not allowed for the release format.
+ *
+ * @param newfile - The new file, whose leading bytes give its class.
+ * @param new_size - The size of the new file.
+ * @param metadata_only - Whether both files have the same content.
+ * @return - The engine to use.
+ */
+const struct delta_engine *delta_engine_choose(const char *newfile, uint64_t new_size, bool metadata_only);
+
+/*
+ * Read the metadata the metadata engine recorded in a delta.
+ *
+ * @param delta - The delta made by the metadata engine.
+ * @param stat - Receives the mode (of a regular file), uid and gid; the
+ * other fields are left alone.
+ * @param xattrs - Receives the extended attributes in the format of
+ * xattrs_get_blob(), NULL when there are none. Caller frees.
+ * @param xattrs_len - Receives the length of "xattrs".
+ * @return - false if the delta is not a valid metadata record.
+ */
+bool read_metadata_record(const char *delta, struct update_stat *stat, char **xattrs, size_t *xattrs_len);
+
+#endif /* __INCLUDE_GUARD_DELTA_H */
@@ -65,6 +65,18 @@
 #include <lzma.h>
 #endif
 
+/* Build toggle for zstd support. Even when built in, zstd is only used
+ * for formats at or above the [Server] zstdformat setting.
+ */
+#ifdef SWUPD_WITH_ZSTD
+#include <zstd.h>
+#define ZSTD_LEVEL 19
+/* window for long distance matching: 128 MiB, the largest that decoders
+ * accept without extra options */
+#define ZSTD_LONG_WINDOW_LOG 27
+#define ZSTD_COMMAND "zstd -19 --long=27 -T0"
+#endif
+
 /* Approximatly the smallest size of a pair of input files which
  * differ by a single bit that bsdiff can produce a more compact
  * deltafile. Files smaller than this are always marked as different.
@@ -107,6 +119,7 @@ struct update_stat {
 struct file {
 	char *filename;
 	char hash[SWUPD_HASH_LEN];
+	char content_hash[SWUPD_HASH_LEN]; /* on demand, see file_content_hash() */
 	bool use_xattrs;
 	int last_change;
 
@@ -130,6 +143,8 @@ struct file {
 	unsigned int is_rename : 1;
 
 	struct file *peer; /* same file in another manifest */
+	GList *delta_sources; /* other files of the pack's from manifest to try as
+				 delta sources, see create_deltas() */
 
 	/* data fields to help rename detection */
 	double rename_score;
@@ -150,6 +165,7 @@ struct packdata {
 	int to;
 	int fullcount;
 	struct manifest *end_manifest;
+	struct manifest *from_manifest;
 };
 
 extern int current_version;
@@ -178,9 +194,22 @@ extern bool read_configuration_file(char *filename);
 extern void release_configuration_data(void);
 extern char *config_image_base(void);
 extern char *config_output_dir(void);
-extern char *config_empty_dir(void);
+extern char *config_object_dir(void);
 extern char *config_debuginfo_path(const char *path);
 extern int config_initial_version(void);
+extern int config_compression_audit(void);
+extern uint64_t config_block_threshold(void);
+extern int config_block_threads(void);
+extern uint64_t config_memory_budget(void);
+extern unsigned long long config_zstd_format(void);
+extern unsigned long long config_shard_format(void);
+extern int config_delta_similarity(void);
+extern int config_delta_audit(void);
+extern unsigned long long config_delta_engine_format(void);
+extern char *config_delta_engine(const char *class);
+extern uint64_t config_delta_large_size(void);
+extern unsigned long long config_manifest_delta_format(void);
+extern unsigned long long config_delta_source_format(void);
 extern bool config_ban_debuginfo(void);
 
 extern void read_current_version(char *filename);
@@ -201,7 +230,11 @@ extern int prune_manifest(struct manifest *manifest);
 extern void clean_renames(struct manifest *manifest);
 extern int remove_deprecated_files(struct manifest *m1, struct manifest *m2, bool (*compfunc)(struct file *, struct file *));
 extern void create_manifest_delta(int oldversion, int newversion, char *module);
-extern void create_manifest_deltas(struct manifest *manifest, GList *last_versions_list);
+extern void create_manifest_deltas(struct manifest *mom, GList *last_versions_list);
+extern int make_manifest_delta(const char *original, const char *newfile, const char *delta,
+			       unsigned long long min_format);
+extern int apply_manifest_delta(const char *original, const char *delta, const char *newfile);
+extern bool is_manifest_delta(const char *delta);
 extern void subtract_manifests_frontend(struct manifest *m1, struct manifest *m2);
 extern void nest_manifest(struct manifest *parent, struct manifest *sub);
 extern void nest_manifest_file(struct manifest *parent, struct file *file);
@@ -222,6 +255,33 @@ extern bool hash_compare(char *hash1, char *hash2);
 extern void hash_set_zeros(char *hash);
 extern bool hash_is_zeros(char *hash);
 extern int compute_hash(struct file *file, char *filename) __attribute__((warn_unused_result));
+extern void compute_hash_for_data(struct file *file, char *filename, const void *data, size_t len);
+extern void compute_hash_for_metadata(struct file *file, const char *xattrs_blob, size_t xattrs_blob_len,
+				      const void *data, size_t len);
+extern const char *file_content_hash(struct file *file, const char *filename);
+
+extern char *object_path(const char *hash);
+extern bool object_store_fetch(const char *hash, const char *target);
+extern void object_store_add(const char *hash, const char *source);
+extern char *delta_object_path(const char *from_hash, const char *to_hash, const char *engine);
+extern bool delta_store_fetch(const char *from_hash, const char *to_hash, const char *engine, const char *target);
+extern void delta_store_add(const char *from_hash, const char *to_hash, const char *engine, const char *source);
+extern bool delta_store_is_useless(const char *from_hash, const char *to_hash, const char *engine);
+extern void delta_store_mark_useless(const char *from_hash, const char *to_hash, const char *engine);
+
+extern bool version_is_sharded(const char *outdir, int version);
+extern int layout_create_dir(const char *outdir, int version, unsigned long long format, const char *kind);
+extern char *fullfile_dir(const char *outdir, int version, const char *hash);
+extern char *delta_dir(const char *outdir, int version, const char *hash);
+
+extern uint64_t estimate_delta_memory(uint64_t old_size, uint64_t new_size);
+extern void admit_task(uint64_t estimate, const char *what);
+extern void release_task(uint64_t estimate);
+
+extern int claim_output(const char *output);
+extern char *claim_tmpfile(const char *output);
+extern bool claim_held(const char *output);
+extern void release_claim(const char *output);
 
 extern void prepare_delta_dir(struct manifest *manifest);
 extern void create_fullfiles(struct manifest *manifest);
@@ -239,6 +299,7 @@ extern char *next_group(void);
 
 extern void apply_heuristics(struct manifest *manifest);
 extern int make_pack(struct packdata *pack);
+extern int make_packs(GList *packs);
 
 extern void maximize_to_full(struct manifest *MoM, struct manifest *full);
 extern void recurse_manifest(struct manifest *manifest);
@@ -259,12 +320,31 @@ extern void type_change_detection(struct manifest *manifest);
 extern void rename_detection(struct manifest *manifest);
 extern void link_renames(GList *newfiles, int to_version);
 extern void final_link(GList *files);
-extern void __create_delta(struct file *file, int from_version, char *from_hash);
+/* what the delta predictor found for a pair of files, see estimate_delta() */
+struct delta_estimate {
+	int similarity;	 /* percent of the new file found in the old one, -1 if unknown */
+	bool compressed; /* the new file holds compressed data */
+};
+
+extern void __create_delta(struct file *file, struct file *from, const struct delta_estimate *estimate);
+extern void create_deltas(struct file *file, GList *sources);
+extern bool delta_worth_trying(struct file *file, const char *original, const char *newfile,
+			       const struct delta_estimate *known, bool *predicted);
+extern void estimate_delta(const char *original, const char *newfile, struct delta_estimate *estimate);
 
 extern void account_delta_hit(void);
 extern void account_delta_miss(void);
+extern void account_compression_choice(int class, int count, int winner, uint64_t size);
+extern void account_compression_trial(uint64_t size);
+extern void account_compression_prediction(int class, bool correct);
+extern void print_compression_statistics(unsigned long long format);
+extern void account_delta_skipped(void);
+extern void account_delta_prediction(bool predicted, bool actual);
+extern void print_delta_prediction_statistics(void);
 
 extern FILE *fopen_exclusive(const char *filename); /* no mode, opens for write only */
+extern int copy_file(const char *from, const char *to);
+extern int link_or_copy(const char *from, const char *to);
 extern void dump_file_info(struct file *file);
 extern void string_or_die(char **strp, const char *fmt, ...);
 extern void print_elapsed_time(const char *step, struct timeval *previous_time, struct timeval *current_time);
@@ -39,4 +39,21 @@ void xattrs_get_blob(const char *filename, char **blob, size_t *blob_len);
  */
 int xattrs_compare(const char *filename1, const char *filename2);
 
+typedef void (*xattrs_callback_t)(const char *name, const char *value,
+				  size_t value_len, void *data);
+
+/*
+ * Call a function for each extended attribute of the given file, in
+ * attribute name order. Values are passed unchanged (not null terminated
+ * unless stored that way).
+ *
+ * @param filename - The file from which the extended attributes will be
+ * read.
+ * @param callback - Called once per extended attribute with its name, value
+ * and value length.
+ * @param data - Opaque pointer handed to the callback.
+ * @return - None.
+ */
+void xattrs_for_each(const char *filename, xattrs_callback_t callback, void *data);
+
 #endif /* __INCLUDE_GUARD_XATTRS_H */
@@ -0,0 +1,110 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Memory-aware admission control for the worker thread pools.
+ *
+ * The pools are sized by CPU count, but xz at high presets and bsdiff can
+ * each need hundreds of MB, so a few large files arriving together could
+ * exhaust the machine. Before starting such work a task states how much
+ * memory it expects to use and waits until that fits in the budget. A task
+ * is always admitted when nothing else is running, so a single oversized
+ * task cannot deadlock the pool.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+#define MiB (1024 * 1024)
+
+static GMutex admission_lock;
+static GCond admission_cond;
+static uint64_t budget;
+static uint64_t in_use;
+static int running;
+
+static uint64_t get_budget(void)
+{
+	long pages, page_size;
+
+	if (budget) {
+		return budget;
+	}
+
+	budget = config_memory_budget() * MiB;
+	if (budget == 0) {
+		/* default: three quarters of physical memory */
+		pages = sysconf(_SC_PHYS_PAGES);
+		page_size = sysconf(_SC_PAGESIZE);
+		if (pages > 0 && page_size > 0) {
+			budget = (uint64_t)pages * page_size / 4 * 3;
+		} else {
+			budget = UINT64_MAX;
+		}
+	}
+	LOG(NULL, "Memory budget", "%llu MiB", (unsigned long long)(budget / MiB));
+
+	return budget;
+}
+
+/* bsdiff holds both files plus two off_t suffix sorting arrays over the
+ * old file, and buffers for the diff and extra blocks of the new file */
+uint64_t estimate_delta_memory(uint64_t old_size, uint64_t new_size)
+{
+	return (2 * sizeof(off_t) + 1) * old_size + 3 * new_size + MiB;
+}
+
+void admit_task(uint64_t estimate, const char *what)
+{
+	bool waited = false;
+
+	g_mutex_lock(&admission_lock);
+	get_budget();
+	while (running > 0 && in_use + estimate > budget) {
+		if (!waited) {
+			LOG(NULL, "Admission deferred", "%s: needs %llu MiB, %llu of %llu MiB in use by %i tasks",
+			    what, (unsigned long long)(estimate / MiB), (unsigned long long)(in_use / MiB),
+			    (unsigned long long)(budget / MiB), running);
+			waited = true;
+		}
+		g_cond_wait(&admission_cond, &admission_lock);
+	}
+	in_use += estimate;
+	running++;
+	LOG(NULL, "Admitted", "%s: %llu MiB, %llu of %llu MiB in use by %i tasks%s",
+	    what, (unsigned long long)(estimate / MiB), (unsigned long long)(in_use / MiB),
+	    (unsigned long long)(budget / MiB), running,
+	    in_use > budget ? " (over budget, running alone)" : "");
+	g_mutex_unlock(&admission_lock);
+}
+
+void release_task(uint64_t estimate)
+{
+	g_mutex_lock(&admission_lock);
+	assert(running > 0 && in_use >= estimate);
+	in_use -= estimate;
+	running--;
+	g_cond_broadcast(&admission_cond);
+	g_mutex_unlock(&admission_lock);
+}
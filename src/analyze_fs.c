@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <linux/limits.h>
 #include <openssl/hmac.h>
@@ -115,17 +116,10 @@ static void hmac_sha256_for_string(char *hash,
 	hmac_sha256_for_data(hash, key, key_len, (const unsigned char *)str, strlen(str));
 }
 
-static void hmac_compute_key(const char *filename,
-			     const struct update_stat *updt_stat,
-			     char *key, size_t *key_len, bool use_xattrs)
+static void hmac_compute_key_for_blob(const struct update_stat *updt_stat,
+				      const char *xattrs_blob, size_t xattrs_blob_len,
+				      char *key, size_t *key_len)
 {
-	char *xattrs_blob = (void *)0xdeadcafe;
-	size_t xattrs_blob_len = 0;
-
-	if (use_xattrs) {
-		xattrs_get_blob(filename, &xattrs_blob, &xattrs_blob_len);
-	}
-
 	hmac_sha256_for_data(key, (const unsigned char *)updt_stat,
 			     sizeof(struct update_stat),
 			     (const unsigned char *)xattrs_blob,
@@ -136,6 +130,20 @@ static void hmac_compute_key(const char *filename,
 	} else {
 		*key_len = SWUPD_HASH_LEN - 1;
 	}
+}
+
+static void hmac_compute_key(const char *filename,
+			     const struct update_stat *updt_stat,
+			     char *key, size_t *key_len, bool use_xattrs)
+{
+	char *xattrs_blob = (void *)0xdeadcafe;
+	size_t xattrs_blob_len = 0;
+
+	if (use_xattrs) {
+		xattrs_get_blob(filename, &xattrs_blob, &xattrs_blob_len);
+	}
+
+	hmac_compute_key_for_blob(updt_stat, xattrs_blob, xattrs_blob_len, key, key_len);
 
 	if (xattrs_blob_len != 0) {
 		free(xattrs_blob);
@@ -245,15 +253,89 @@ int compute_hash(struct file *file, char *filename)
 	blob = mmap(NULL, file->stat.st_size, PROT_READ, MAP_PRIVATE, fileno(fl), 0);
 	assert(!(blob == MAP_FAILED && file->stat.st_size != 0));
 
+	compute_hash_for_data(file, filename, blob, file->stat.st_size);
+	munmap(blob, file->stat.st_size);
+	fclose(fl);
+	return 0;
+}
+
+/* Hash a regular file whose content is already in memory. The HMAC key is
+ * still derived from file->stat and the xattrs of "filename", so the result
+ * is identical to compute_hash() on a file holding the same data. */
+void compute_hash_for_data(struct file *file, char *filename, const void *data, size_t len)
+{
+	char key[SWUPD_HASH_LEN];
+	size_t key_len;
+
+	hash_set_zeros(key);
 	hmac_compute_key(filename, &file->stat, key, &key_len, file->use_xattrs);
 	hmac_sha256_for_data(file->hash,
 			     (const unsigned char *)key,
 			     key_len,
-			     blob,
-			     file->stat.st_size);
-	munmap(blob, file->stat.st_size);
-	fclose(fl);
-	return 0;
+			     (const unsigned char *)data,
+			     len);
+}
+
+/* Hash a regular file from its content and metadata given separately:
+ * file->stat and, when file->use_xattrs is set, the xattrs in the format
+ * of xattrs_get_blob(). */
+void compute_hash_for_metadata(struct file *file, const char *xattrs_blob, size_t xattrs_blob_len,
+			       const void *data, size_t len)
+{
+	char key[SWUPD_HASH_LEN];
+	size_t key_len;
+
+	hash_set_zeros(key);
+	if (!file->use_xattrs || xattrs_blob_len == 0) {
+		xattrs_blob = (void *)0xdeadcafe;
+		xattrs_blob_len = 0;
+	}
+	hmac_compute_key_for_blob(&file->stat, xattrs_blob, xattrs_blob_len, key, &key_len);
+	hmac_sha256_for_data(file->hash,
+			     (const unsigned char *)key,
+			     key_len,
+			     (const unsigned char *)data,
+			     len);
+}
+
+/* The digest of the content alone of the regular file "filename". Unlike
+ * file->hash it does not change with the mode, ownership or xattrs, so it
+ * tells metadata-only changes apart. Computed on first use and kept in
+ * file->content_hash. Returns NULL if the file cannot be read. */
+const char *file_content_hash(struct file *file, const char *filename)
+{
+	struct stat st;
+	void *blob = NULL;
+	int fd;
+
+	if (file->content_hash[0]) {
+		return file->content_hash;
+	}
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size > 0) {
+		blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (blob == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	hmac_sha256_for_data(file->content_hash, (const unsigned char *)"", 0,
+			     blob ? blob : (const unsigned char *)"", st.st_size);
+	if (blob) {
+		munmap(blob, st.st_size);
+	}
+
+	return file->content_hash;
 }
 
 static void get_hash(gpointer data, gpointer user_data)
@@ -0,0 +1,87 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <bsdiff.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+static const struct option prog_opts[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "log-stdout", no_argument, 0, 'l' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char *name)
+{
+	printf("usage:\n");
+	printf("   %s <old manifest> <delta> <new manifest>\n\n", name);
+	printf("Recreates a manifest from an older one and a manifest delta, either\n");
+	printf("a record delta or a bsdiff delta, to verify what clients will get.\n\n");
+	printf("Help options:\n");
+	printf("   -h, --help              Show help options\n");
+	printf("   -l, --log-stdout        Write log messages also to stdout\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int ret;
+
+	if (!setlocale(LC_ALL, "")) {
+		fprintf(stderr, "%s: setlocale() failed\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	while ((opt = getopt_long(argc, argv, "hl", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case '?':
+		case 'h':
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		case 'l':
+			init_log_stdout();
+			break;
+		}
+	}
+
+	if (argc - optind != 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (is_manifest_delta(argv[optind + 1])) {
+		ret = apply_manifest_delta(argv[optind], argv[optind + 1], argv[optind + 2]);
+	} else {
+		ret = apply_bsdiff_delta(argv[optind], argv[optind + 2], argv[optind + 1]);
+	}
+
+	if (ret != 0) {
+		printf("Failed to apply %s to %s\n", argv[optind + 1], argv[optind]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
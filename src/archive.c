@@ -0,0 +1,890 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* In-process tar writer and compressors.
+ *
+ * Fullfiles are single-member tar archives. Rather than forking tar once per
+ * compression type, the archive is generated here (POSIX pax format, the
+ * same format GNU tar switches to for --xattrs) and fed to zlib, liblzma and
+ * libbz2 encoders from one read of the source file.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "swupd.h"
+#include "xattrs.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_READ_SIZE (128 * 1024)
+#define COMPRESSOR_BUF_SIZE (64 * 1024)
+/* bound the input handed to an encoder at once; zlib and libbz2 count
+ * input bytes in unsigned int */
+#define COMPRESSOR_CHUNK_SIZE (1024 * 1024)
+
+/* tar -J and -z use the xz and gzip default presets, tar -j uses bzip2 -9 */
+#define XZ_PRESET 6
+/* room for the tar headers when the xz dictionary is sized to the input */
+#define XZ_DICT_SLACK (64 * 1024)
+#define BZIP2_BLOCK_SIZE_100K 9
+
+#ifdef SWUPD_WITH_ZSTD
+#include <zdict.h>
+
+static ZSTD_CDict *dictionary;
+static unsigned int dictionary_id;
+#endif
+
+struct compressor {
+	enum compression_type type;
+	int threads;
+	char *filename;
+	int fd; /* -1 for a trial compressor that only counts its output */
+	uint64_t size;
+	union {
+		z_stream gz;
+#ifdef SWUPD_WITH_LZMA
+		lzma_stream xz;
+#endif
+#ifdef SWUPD_WITH_BZIP2
+		bz_stream bz;
+#endif
+#ifdef SWUPD_WITH_ZSTD
+		ZSTD_CCtx *zstd;
+#endif
+	} strm;
+	unsigned char buf[COMPRESSOR_BUF_SIZE];
+};
+
+/* ustar header block; all numeric fields are NUL terminated octal */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct pax_records {
+	char *data;
+	size_t len;
+};
+
+const char *compression_suffix(enum compression_type type)
+{
+	switch (type) {
+	case COMPRESSION_GZIP:
+		return ".gz";
+	case COMPRESSION_XZ:
+		return ".xz";
+	case COMPRESSION_BZIP2:
+		return ".bz2";
+	case COMPRESSION_ZSTD:
+		return ".zst";
+	default:
+		assert(0);
+	}
+	return "";
+}
+
+bool compression_available(enum compression_type type)
+{
+	switch (type) {
+	case COMPRESSION_GZIP:
+		return true;
+#ifdef SWUPD_WITH_LZMA
+	case COMPRESSION_XZ:
+		return true;
+#endif
+#ifdef SWUPD_WITH_BZIP2
+	case COMPRESSION_BZIP2:
+		return true;
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	case COMPRESSION_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool compression_enabled(enum compression_type type, unsigned long long format)
+{
+	unsigned long long zstd_format;
+
+	if (!compression_available(type)) {
+		return false;
+	}
+	if (type == COMPRESSION_ZSTD) {
+		/* older clients cannot decompress zstd, it takes a format bump */
+		zstd_format = config_zstd_format();
+		return zstd_format > 0 && format >= zstd_format;
+	}
+
+	return true;
+}
+
+#ifdef SWUPD_WITH_ZSTD
+/* large zstd inputs get long distance matching over a wider window */
+static bool zstd_long_mode(uint64_t size)
+{
+	return size >= (1ULL << ZSTD_LONG_WINDOW_LOG) / 4;
+}
+#endif
+
+uint64_t compressor_memusage(enum compression_type type, int threads, __unused__ uint64_t size)
+{
+	uint64_t usage = sizeof(struct compressor) + TAR_READ_SIZE;
+
+	switch (type) {
+	case COMPRESSION_GZIP:
+		/* zlib: (1 << (windowBits + 2)) + (1 << (memLevel + 9)) */
+		usage += (1 << 17) + (1 << 17);
+		break;
+#ifdef SWUPD_WITH_LZMA
+	case COMPRESSION_XZ:
+		if (threads > 1) {
+			lzma_mt mt = {
+				.threads = threads,
+				.preset = XZ_PRESET,
+				.check = LZMA_CHECK_CRC64,
+			};
+
+			usage += lzma_stream_encoder_mt_memusage(&mt);
+		} else {
+			usage += lzma_easy_encoder_memusage(XZ_PRESET);
+		}
+		break;
+#endif
+#ifdef SWUPD_WITH_BZIP2
+	case COMPRESSION_BZIP2:
+		/* 400k + 8 x block size, see the bzip2 manual */
+		usage += 400 * 1024 + 8 * BZIP2_BLOCK_SIZE_100K * 100 * 1024;
+		break;
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	case COMPRESSION_ZSTD:
+		/* one context per worker, plus the long distance matching
+		 * window whenever compressor_size_hint() enables it, which the
+		 * workers' job buffers double */
+		usage += ZSTD_estimateCStreamSize(ZSTD_LEVEL) * (threads > 1 ? threads : 1);
+		if (zstd_long_mode(size)) {
+			usage += 1ULL << ZSTD_LONG_WINDOW_LOG;
+		}
+		if (threads > 1) {
+			usage += 1ULL << ZSTD_LONG_WINDOW_LOG;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return usage;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* write out whatever the encoder produced into comp->buf */
+static int compressor_flush(struct compressor *comp, size_t avail_out)
+{
+	size_t len = COMPRESSOR_BUF_SIZE - avail_out;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (comp->filename && write_all(comp->fd, comp->buf, len) != 0) {
+		LOG(NULL, "Failed to write", "%s: %s", comp->filename, strerror(errno));
+		return -1;
+	}
+	comp->size += len;
+
+	return 0;
+}
+
+struct compressor *compressor_open(enum compression_type type, const char *filename)
+{
+	return compressor_open_threads(type, filename, 1);
+}
+
+struct compressor *compressor_open_threads(enum compression_type type, const char *filename, int threads)
+{
+	struct compressor *comp;
+	int ret = -1;
+
+	if (!compression_available(type)) {
+		LOG(NULL, "Compression type not supported", "%i", type);
+		return NULL;
+	}
+
+	comp = calloc(1, sizeof(struct compressor));
+	if (comp == NULL) {
+		assert(0);
+	}
+	comp->type = type;
+	comp->threads = threads;
+	comp->fd = -1;
+	if (filename) {
+		comp->filename = strdup(filename);
+		if (comp->filename == NULL) {
+			assert(0);
+		}
+	}
+
+	switch (type) {
+	case COMPRESSION_GZIP:
+		/* 15 + 16: default window with a gzip wrapper */
+		ret = deflateInit2(&comp->strm.gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				   15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+		break;
+#ifdef SWUPD_WITH_LZMA
+	case COMPRESSION_XZ: {
+		lzma_stream init = LZMA_STREAM_INIT;
+
+		comp->strm.xz = init;
+		if (threads > 1) {
+			/* independent blocks of the default size (3x the preset's
+			 * dictionary), encoded in parallel */
+			lzma_mt mt = {
+				.threads = threads,
+				.preset = XZ_PRESET,
+				.check = LZMA_CHECK_CRC64,
+			};
+
+			ret = lzma_stream_encoder_mt(&comp->strm.xz, &mt) == LZMA_OK ? 0 : -1;
+		} else {
+			ret = lzma_easy_encoder(&comp->strm.xz, XZ_PRESET, LZMA_CHECK_CRC64) == LZMA_OK ? 0 : -1;
+		}
+		break;
+	}
+#endif
+#ifdef SWUPD_WITH_BZIP2
+	case COMPRESSION_BZIP2:
+		ret = BZ2_bzCompressInit(&comp->strm.bz, BZIP2_BLOCK_SIZE_100K, 0, 0) == BZ_OK ? 0 : -1;
+		break;
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	case COMPRESSION_ZSTD:
+		comp->strm.zstd = ZSTD_createCCtx();
+		if (!comp->strm.zstd ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(comp->strm.zstd, ZSTD_c_compressionLevel, ZSTD_LEVEL)) ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(comp->strm.zstd, ZSTD_c_checksumFlag, 1))) {
+			ZSTD_freeCCtx(comp->strm.zstd);
+			break;
+		}
+		/* libzstd may be built without threading support, then the
+		 * stream is simply compressed by this thread */
+		if (threads > 1) {
+			ZSTD_CCtx_setParameter(comp->strm.zstd, ZSTD_c_nbWorkers, threads);
+		}
+		ret = 0;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (ret != 0) {
+		LOG(NULL, "Failed to initialize compressor", "%s", filename ? filename : "(trial)");
+		free(comp->filename);
+		free(comp);
+		return NULL;
+	}
+
+	if (!filename) {
+		return comp;
+	}
+	comp->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (comp->fd < 0) {
+		LOG(NULL, "Failed to create", "%s: %s", filename, strerror(errno));
+		compressor_close(comp, NULL);
+		return NULL;
+	}
+
+	return comp;
+}
+
+/* run the encoder over "len" bytes of input, or finish the stream when
+ * "finish" is set */
+static int compressor_run(struct compressor *comp, const void *data, size_t len, bool finish)
+{
+	switch (comp->type) {
+	case COMPRESSION_GZIP: {
+		z_stream *strm = &comp->strm.gz;
+		int ret;
+
+		strm->next_in = (Bytef *)data;
+		strm->avail_in = len;
+		do {
+			strm->next_out = comp->buf;
+			strm->avail_out = COMPRESSOR_BUF_SIZE;
+			ret = deflate(strm, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR || compressor_flush(comp, strm->avail_out) != 0) {
+				return -1;
+			}
+		} while (finish ? ret != Z_STREAM_END : strm->avail_in > 0);
+		return 0;
+	}
+#ifdef SWUPD_WITH_LZMA
+	case COMPRESSION_XZ: {
+		lzma_stream *strm = &comp->strm.xz;
+		lzma_ret ret;
+
+		strm->next_in = data;
+		strm->avail_in = len;
+		do {
+			strm->next_out = comp->buf;
+			strm->avail_out = COMPRESSOR_BUF_SIZE;
+			ret = lzma_code(strm, finish ? LZMA_FINISH : LZMA_RUN);
+			if ((ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+			    compressor_flush(comp, strm->avail_out) != 0) {
+				return -1;
+			}
+		} while (finish ? ret != LZMA_STREAM_END : strm->avail_in > 0);
+		return 0;
+	}
+#endif
+#ifdef SWUPD_WITH_BZIP2
+	case COMPRESSION_BZIP2: {
+		bz_stream *strm = &comp->strm.bz;
+		int ret;
+
+		strm->next_in = (char *)data;
+		strm->avail_in = len;
+		do {
+			strm->next_out = (char *)comp->buf;
+			strm->avail_out = COMPRESSOR_BUF_SIZE;
+			ret = BZ2_bzCompress(strm, finish ? BZ_FINISH : BZ_RUN);
+			if (ret < 0 || compressor_flush(comp, strm->avail_out) != 0) {
+				return -1;
+			}
+		} while (finish ? ret != BZ_STREAM_END : strm->avail_in > 0);
+		return 0;
+	}
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	case COMPRESSION_ZSTD: {
+		ZSTD_inBuffer in = { data, len, 0 };
+		ZSTD_outBuffer out;
+		size_t ret;
+
+		do {
+			out.dst = comp->buf;
+			out.size = COMPRESSOR_BUF_SIZE;
+			out.pos = 0;
+			ret = ZSTD_compressStream2(comp->strm.zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(ret) || compressor_flush(comp, COMPRESSOR_BUF_SIZE - out.pos) != 0) {
+				return -1;
+			}
+		} while (finish ? ret != 0 : in.pos < in.size);
+		return 0;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+void compressor_size_hint(__unused__ struct compressor *comp, __unused__ uint64_t size)
+{
+#ifdef SWUPD_WITH_LZMA
+	if (comp->type == COMPRESSION_XZ && comp->threads <= 1) {
+		lzma_options_lzma opt;
+		lzma_filter filters[] = {
+			{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+			{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+		};
+
+		/* the preset's 8 MiB dictionary costs more to set up than
+		 * compressing a small input; one covering the whole input
+		 * compresses it the same */
+		if (lzma_lzma_preset(&opt, XZ_PRESET) || size + XZ_DICT_SLACK >= opt.dict_size) {
+			return;
+		}
+		opt.dict_size = size + XZ_DICT_SLACK;
+		lzma_end(&comp->strm.xz);
+		if (lzma_stream_encoder(&comp->strm.xz, filters, LZMA_CHECK_CRC64) != LZMA_OK) {
+			/* a failed encoder makes the first write fail */
+			LOG(NULL, "Failed to resize xz dictionary", "%s", comp->filename ? comp->filename : "(trial)");
+		}
+		return;
+	}
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	if (comp->type != COMPRESSION_ZSTD) {
+		return;
+	}
+	if (zstd_long_mode(size)) {
+		ZSTD_CCtx_setParameter(comp->strm.zstd, ZSTD_c_enableLongDistanceMatching, 1);
+		ZSTD_CCtx_setParameter(comp->strm.zstd, ZSTD_c_windowLog, ZSTD_LONG_WINDOW_LOG);
+	} else if (dictionary && size <= DICTIONARY_FILE_MAX) {
+		/* the dictionary carries its own compression level */
+		ZSTD_CCtx_refCDict(comp->strm.zstd, dictionary);
+	}
+#endif
+}
+
+size_t compression_train_dictionary(__unused__ void *dict, __unused__ size_t capacity,
+				    __unused__ const void *samples, __unused__ const size_t *sizes,
+				    __unused__ unsigned int count)
+{
+#ifdef SWUPD_WITH_ZSTD
+	size_t ret;
+
+	ret = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, count);
+	if (ZDICT_isError(ret)) {
+		LOG(NULL, "Dictionary training failed", "%u samples: %s", count, ZDICT_getErrorName(ret));
+		return 0;
+	}
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+bool compression_use_dictionary(__unused__ const void *dict, __unused__ size_t len)
+{
+#ifdef SWUPD_WITH_ZSTD
+	compression_free_dictionary();
+	dictionary = ZSTD_createCDict(dict, len, ZSTD_LEVEL);
+	if (dictionary) {
+		dictionary_id = ZDICT_getDictID(dict, len);
+	}
+	return dictionary != NULL;
+#else
+	return false;
+#endif
+}
+
+bool compression_have_dictionary(void)
+{
+#ifdef SWUPD_WITH_ZSTD
+	return dictionary != NULL;
+#else
+	return false;
+#endif
+}
+
+unsigned int compression_dictionary_id(void)
+{
+#ifdef SWUPD_WITH_ZSTD
+	return dictionary ? dictionary_id : 0;
+#else
+	return 0;
+#endif
+}
+
+void compression_free_dictionary(void)
+{
+#ifdef SWUPD_WITH_ZSTD
+	ZSTD_freeCDict(dictionary);
+	dictionary = NULL;
+	dictionary_id = 0;
+#endif
+}
+
+int compressor_write(struct compressor *comp, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = len < COMPRESSOR_CHUNK_SIZE ? len : COMPRESSOR_CHUNK_SIZE;
+		if (compressor_run(comp, p, chunk, false) != 0) {
+			LOG(NULL, "Compression failed", "%s", comp->filename ? comp->filename : "(trial)");
+			return -1;
+		}
+		p += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+int compressor_close(struct compressor *comp, uint64_t *size)
+{
+	int ret = 0;
+
+	if (!comp->filename || comp->fd >= 0) {
+		if (compressor_run(comp, NULL, 0, true) != 0) {
+			LOG(NULL, "Compression failed", "%s", comp->filename ? comp->filename : "(trial)");
+			ret = -1;
+		}
+	}
+	if (comp->fd >= 0) {
+		if (close(comp->fd) != 0) {
+			LOG(NULL, "Failed to close", "%s: %s", comp->filename, strerror(errno));
+			ret = -1;
+		}
+	}
+
+	switch (comp->type) {
+	case COMPRESSION_GZIP:
+		deflateEnd(&comp->strm.gz);
+		break;
+#ifdef SWUPD_WITH_LZMA
+	case COMPRESSION_XZ:
+		lzma_end(&comp->strm.xz);
+		break;
+#endif
+#ifdef SWUPD_WITH_BZIP2
+	case COMPRESSION_BZIP2:
+		BZ2_bzCompressEnd(&comp->strm.bz);
+		break;
+#endif
+#ifdef SWUPD_WITH_ZSTD
+	case COMPRESSION_ZSTD:
+		ZSTD_freeCCtx(comp->strm.zstd);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (size) {
+		*size = comp->size;
+	}
+	free(comp->filename);
+	free(comp);
+
+	return ret;
+}
+
+static int write_to_all(struct compressor **out, int count, const void *data, size_t len)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (compressor_write(out[i], data, len) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* a numeric header field; returns false if the value does not fit */
+static bool tar_octal(char *field, size_t size, unsigned long long value)
+{
+	char tmp[32];
+
+	if (snprintf(tmp, sizeof(tmp), "%0*llo", (int)size - 1, value) != (int)size - 1) {
+		memset(field, '0', size - 1);
+		field[size - 1] = '\0';
+		return false;
+	}
+	memcpy(field, tmp, size);
+
+	return true;
+}
+
+/* "%d key=value\n", where the length includes its own digits */
+static void pax_add(struct pax_records *pax, const char *key, const char *value, size_t value_len)
+{
+	size_t len = strlen(key) + value_len + 3; /* ' ', '=' and '\n' */
+	size_t digits = 1;
+	size_t total;
+	char *p;
+	int n;
+
+	for (;;) {
+		total = len + digits;
+		n = snprintf(NULL, 0, "%zu", total);
+		if ((size_t)n == digits) {
+			break;
+		}
+		digits = n;
+	}
+
+	pax->data = realloc(pax->data, pax->len + total + 1);
+	if (pax->data == NULL) {
+		assert(0);
+	}
+	p = pax->data + pax->len;
+	p += sprintf(p, "%zu %s=", total, key);
+	memcpy(p, value, value_len);
+	p[value_len] = '\n';
+	pax->len += total;
+}
+
+static void pax_add_number(struct pax_records *pax, const char *key, unsigned long long value)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu", value);
+	pax_add(pax, key, buf, strlen(buf));
+}
+
+static void pax_add_xattr(const char *name, const char *value, size_t value_len, void *data)
+{
+	struct pax_records *pax = data;
+	char *key;
+
+	string_or_die(&key, "SCHILY.xattr.%s", name);
+	pax_add(pax, key, value, value_len);
+	free(key);
+#if SWUPD_WITH_SELINUX
+	/* tar --selinux keeps the context in its own record */
+	if (strcmp(name, "security.selinux") == 0) {
+		pax_add(pax, "RHT.security.selinux", value, value_len);
+	}
+#endif
+}
+
+static void tar_checksum(struct tar_header *header)
+{
+	const unsigned char *p = (const unsigned char *)header;
+	unsigned int sum = 0;
+	size_t i;
+
+	memset(header->chksum, ' ', sizeof(header->chksum));
+	for (i = 0; i < sizeof(struct tar_header); i++) {
+		sum += p[i];
+	}
+	snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+	header->chksum[7] = ' ';
+}
+
+static void tar_owner_names(struct tar_header *header, uid_t uid, gid_t gid)
+{
+	struct passwd pw, *pwp = NULL;
+	struct group gr, *grp = NULL;
+	char buf[4096];
+
+	if (getpwuid_r(uid, &pw, buf, sizeof(buf), &pwp) == 0 && pwp) {
+		strncpy(header->uname, pwp->pw_name, sizeof(header->uname) - 1);
+	}
+	if (getgrgid_r(gid, &gr, buf, sizeof(buf), &grp) == 0 && grp) {
+		strncpy(header->gname, grp->gr_name, sizeof(header->gname) - 1);
+	}
+}
+
+static void tar_init_header(struct tar_header *header, struct stat *st)
+{
+	memset(header, 0, sizeof(struct tar_header));
+	tar_octal(header->mode, sizeof(header->mode), st->st_mode & 07777);
+	tar_octal(header->mtime, sizeof(header->mtime), st->st_mtime < 0 ? 0 : st->st_mtime);
+	memcpy(header->magic, "ustar", 6);
+	memcpy(header->version, "00", 2);
+	tar_owner_names(header, st->st_uid, st->st_gid);
+}
+
+static int write_padding(struct compressor **out, int count, uint64_t len)
+{
+	static const char zeros[TAR_BLOCK_SIZE];
+	size_t pad = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+	return write_to_all(out, count, zeros, pad);
+}
+
+static int write_file_data(const char *path, uint64_t size, struct compressor **out, int count)
+{
+	char *buf;
+	uint64_t total = 0;
+	ssize_t len;
+	int fd;
+	int ret = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		LOG(NULL, "Failed to open", "%s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	buf = malloc(TAR_READ_SIZE);
+	if (buf == NULL) {
+		assert(0);
+	}
+
+	while (total < size) {
+		len = read(fd, buf, TAR_READ_SIZE);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			LOG(NULL, "Short read", "%s: %s", path, len < 0 ? strerror(errno) : "file shrank");
+			goto out;
+		}
+		if ((uint64_t)len > size - total) {
+			LOG(NULL, "File grew while archiving", "%s", path);
+			goto out;
+		}
+		if (write_to_all(out, count, buf, len) != 0) {
+			goto out;
+		}
+		total += len;
+	}
+	ret = write_padding(out, count, size);
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+int tar_write_member(const char *path, const char *name, struct compressor **out, int count)
+{
+	static const char zeros[2 * TAR_BLOCK_SIZE];
+	struct tar_header header;
+	struct pax_records pax = { NULL, 0 };
+	struct stat st;
+	char link[PATH_MAX];
+	char *member = NULL;
+	uint64_t size = 0;
+	int ret = -1;
+
+	assert(sizeof(struct tar_header) == TAR_BLOCK_SIZE);
+
+	if (lstat(path, &st) != 0) {
+		LOG(NULL, "Failed to stat", "%s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	tar_init_header(&header, &st);
+
+	if (S_ISREG(st.st_mode)) {
+		header.typeflag = '0';
+		size = st.st_size;
+		string_or_die(&member, "%s", name);
+	} else if (S_ISDIR(st.st_mode)) {
+		header.typeflag = '5';
+		string_or_die(&member, "%s/", name);
+	} else if (S_ISLNK(st.st_mode)) {
+		ssize_t len = readlink(path, link, sizeof(link) - 1);
+
+		if (len < 0) {
+			LOG(NULL, "readlink error", "%s: %s", path, strerror(errno));
+			return -1;
+		}
+		link[len] = '\0';
+		header.typeflag = '2';
+		string_or_die(&member, "%s", name);
+		if ((size_t)len < sizeof(header.linkname)) {
+			memcpy(header.linkname, link, len);
+		} else {
+			pax_add(&pax, "linkpath", link, len);
+		}
+	} else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+		header.typeflag = S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6';
+		tar_octal(header.devmajor, sizeof(header.devmajor), major(st.st_rdev));
+		tar_octal(header.devminor, sizeof(header.devminor), minor(st.st_rdev));
+		string_or_die(&member, "%s", name);
+	} else {
+		LOG(NULL, "Unsupported file type for tar", "%s", path);
+		return -1;
+	}
+
+	if (strlen(member) < sizeof(header.name)) {
+		memcpy(header.name, member, strlen(member));
+	} else {
+		pax_add(&pax, "path", member, strlen(member));
+		memcpy(header.name, member, sizeof(header.name) - 1);
+	}
+	if (!tar_octal(header.uid, sizeof(header.uid), st.st_uid)) {
+		pax_add_number(&pax, "uid", st.st_uid);
+	}
+	if (!tar_octal(header.gid, sizeof(header.gid), st.st_gid)) {
+		pax_add_number(&pax, "gid", st.st_gid);
+	}
+	if (!tar_octal(header.size, sizeof(header.size), size)) {
+		pax_add_number(&pax, "size", size);
+	}
+	xattrs_for_each(path, pax_add_xattr, &pax);
+
+	if (pax.len > 0) {
+		struct tar_header xheader = header;
+		char *xname;
+
+		string_or_die(&xname, "PaxHeaders.0/%s", member);
+		memset(xheader.name, 0, sizeof(xheader.name));
+		memcpy(xheader.name, xname, strnlen(xname, sizeof(xheader.name) - 1));
+		free(xname);
+		memset(xheader.linkname, 0, sizeof(xheader.linkname));
+		tar_octal(xheader.mode, sizeof(xheader.mode), 0644);
+		tar_octal(xheader.size, sizeof(xheader.size), pax.len);
+		xheader.typeflag = 'x';
+		tar_checksum(&xheader);
+
+		if (write_to_all(out, count, &xheader, sizeof(xheader)) != 0 ||
+		    write_to_all(out, count, pax.data, pax.len) != 0 ||
+		    write_padding(out, count, pax.len) != 0) {
+			goto out;
+		}
+	}
+
+	tar_checksum(&header);
+	if (write_to_all(out, count, &header, sizeof(header)) != 0) {
+		goto out;
+	}
+
+	if (size > 0 && write_file_data(path, size, out, count) != 0) {
+		goto out;
+	}
+
+	/* end of archive: two zero blocks */
+	ret = write_to_all(out, count, zeros, sizeof(zeros));
+out:
+	free(pax.data);
+	free(member);
+	return ret;
+}
@@ -0,0 +1,362 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Output claims.
+ *
+ * Some outputs, such as the manifest deltas, are wanted by several
+ * producers at once: swupd_create_update and any number of pack makers,
+ * each with several threads. Instead of all of them racing on one dotfile,
+ * a producer first claims the output by creating ".<output>.claim" next to
+ * it with O_EXCL; it holds the host, pid and thread id of the owner. Only
+ * the owner builds the output, in a temporary file of its own (see
+ * claim_tmpfile()), and removes the claim when done. The others wait for
+ * the claim to go away with inotify and then find the output finished, or
+ * claim it themselves when the owner gave up.
+ *
+ * A claim whose owner died is broken: on the same host when the owner pid
+ * no longer exists, and on other hosts (shared output directories) when
+ * the claim is older than CLAIM_STALE_SECONDS. Breaking can race with a
+ * new claim and end up displacing it; the displaced owner finds out with
+ * claim_held() before it publishes anything.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+/* how often a waiter checks whether the owner is still alive */
+#define CLAIM_CHECK_SECONDS 60
+#define CLAIM_STALE_SECONDS 3600
+
+/* ".<name>.claim" in the directory of "output". Caller frees. */
+static char *claim_path(const char *output)
+{
+	char *dir, *name;
+	char *claim;
+
+	dir = g_path_get_dirname(output);
+	name = g_path_get_basename(output);
+	string_or_die(&claim, "%s/.%s.claim", dir, name);
+	free(dir);
+	free(name);
+
+	return claim;
+}
+
+static char *claim_owner(void)
+{
+	char host[HOST_NAME_MAX + 1] = { 0 };
+	char *owner;
+
+	if (gethostname(host, sizeof(host) - 1) != 0) {
+		strcpy(host, "localhost");
+	}
+	string_or_die(&owner, "%s %i %li\n", host, (int)getpid(), (long)syscall(SYS_gettid));
+
+	return owner;
+}
+
+/* ".<name>.<host>.<pid>.<tid>" in the directory of "output" for the given
+ * claim content. Caller frees. */
+static char *owner_tmpfile(const char *output, const char *owner)
+{
+	char *dir, *name;
+	char *token;
+	char *tmpfile;
+
+	dir = g_path_get_dirname(output);
+	name = g_path_get_basename(output);
+	token = g_strdup(owner);
+	g_strstrip(token);
+	g_strdelimit(token, " /", '.');
+	string_or_die(&tmpfile, "%s/.%s.%s", dir, name, token);
+	free(dir);
+	free(name);
+	g_free(token);
+
+	return tmpfile;
+}
+
+/* Returns the content of the claim file, NULL if it does not exist */
+static char *read_claim(const char *claim)
+{
+	char *content = NULL;
+
+	if (!g_file_get_contents(claim, &content, NULL, NULL)) {
+		return NULL;
+	}
+	return content;
+}
+
+static bool claim_is_stale(const char *claim, const char *content)
+{
+	char host[HOST_NAME_MAX + 1] = { 0 };
+	char owner_host[HOST_NAME_MAX + 1];
+	struct stat st;
+	int pid;
+
+	if (sscanf(content, "%" G_STRINGIFY(HOST_NAME_MAX) "s %i", owner_host, &pid) == 2 &&
+	    gethostname(host, sizeof(host) - 1) == 0 && strcmp(host, owner_host) == 0) {
+		/* a live owner here may simply be working on a large output */
+		return kill(pid, 0) != 0 && errno == ESRCH;
+	}
+
+	/* the pid of another host cannot be checked, only the claim age */
+	if (stat(claim, &st) != 0) {
+		return false;
+	}
+	return time(NULL) - st.st_mtime > CLAIM_STALE_SECONDS;
+}
+
+/* Move the claim away, and only drop it if it is still the stale one; a
+ * new owner may have claimed the output in the meantime. If that claim
+ * cannot be put back because yet another one took its place, its owner
+ * has lost it and sees so in claim_held(). Returns false if the claim
+ * could not be moved. */
+static bool break_claim(const char *output, const char *claim, const char *stale)
+{
+	char *moved;
+	char *content;
+	char *tmpfile;
+
+	string_or_die(&moved, "%s.broken.%i", claim, (int)getpid());
+	if (rename(claim, moved) != 0) {
+		LOG(NULL, "Failed to break claim", "%s: %s", claim, strerror(errno));
+		free(moved);
+		return false;
+	}
+
+	content = read_claim(moved);
+	if (content && strcmp(content, stale) == 0) {
+		/* the dead owner's partial output goes with its claim */
+		tmpfile = owner_tmpfile(output, stale);
+		unlink(tmpfile);
+		free(tmpfile);
+		LOG(NULL, "Broke stale claim", "%s held by %s", claim, g_strstrip(content));
+	} else if (link(moved, claim) != 0) {
+		LOG(NULL, "Failed to restore claim", "%s: %s", claim, strerror(errno));
+	}
+	unlink(moved);
+	free(content);
+	free(moved);
+	return true;
+}
+
+/* Wait until "claim" is removed or renamed. Returns 0 when it is gone, 1
+ * after "seconds" without it going away, -1 if it cannot be watched. */
+static int wait_for_release(const char *claim, int seconds)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct pollfd pfd;
+	gint64 deadline;
+	gint64 remaining;
+	char *dir, *name;
+	ssize_t len;
+	char *p;
+	int fd;
+	int ret = -1;
+
+	dir = g_path_get_dirname(claim);
+	name = g_path_get_basename(claim);
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		LOG(NULL, "Failed to create inotify instance", "%s", strerror(errno));
+		goto out;
+	}
+	if (inotify_add_watch(fd, dir, IN_DELETE | IN_MOVED_FROM) < 0) {
+		LOG(NULL, "Failed to watch directory", "%s: %s", dir, strerror(errno));
+		goto out;
+	}
+
+	/* released before the watch was in place */
+	if (access(claim, F_OK) != 0) {
+		ret = 0;
+		goto out;
+	}
+
+	deadline = g_get_monotonic_time() + (gint64)seconds * G_USEC_PER_SEC;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (ret < 0) {
+		remaining = (deadline - g_get_monotonic_time()) / 1000;
+		if (remaining <= 0) {
+			ret = 1;
+			break;
+		}
+		if (poll(&pfd, 1, remaining) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(NULL, "Failed to wait for claim", "%s: %s", claim, strerror(errno));
+			break;
+		}
+		if (!(pfd.revents & POLLIN)) {
+			continue;
+		}
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			break;
+		}
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if (event->len > 0 && strcmp(event->name, name) == 0) {
+				ret = 0;
+			}
+		}
+	}
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(dir);
+	free(name);
+	return ret;
+}
+
+/* Claim the right to produce "output". Returns 1 when the caller owns the
+ * claim and has to produce the output and then call release_claim(), 0
+ * when there is nothing left to do: the output exists, or another producer
+ * owns it and waiting for it is not possible. */
+int claim_output(const char *output)
+{
+	char *claim;
+	char *owner;
+	char *content;
+	ssize_t len;
+	int fd;
+	int ret = 0;
+
+	claim = claim_path(output);
+	owner = claim_owner();
+
+	while (access(output, F_OK) != 0) {
+		fd = open(claim, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd >= 0) {
+			len = write(fd, owner, strlen(owner));
+			close(fd);
+			if (len != (ssize_t)strlen(owner)) {
+				LOG(NULL, "Failed to write claim", "%s", claim);
+				unlink(claim);
+				break;
+			}
+			/* the previous owner may have finished in between */
+			if (access(output, F_OK) == 0) {
+				unlink(claim);
+				break;
+			}
+			ret = 1;
+			break;
+		}
+		if (errno != EEXIST) {
+			LOG(NULL, "Failed to claim", "%s: %s", claim, strerror(errno));
+			break;
+		}
+
+		/* a claim left by a crashed owner is broken right away, only a
+		 * live owner is waited for */
+		content = read_claim(claim);
+		if (content && claim_is_stale(claim, content) && break_claim(output, claim, content)) {
+			free(content);
+			continue;
+		}
+		free(content);
+
+		if (wait_for_release(claim, CLAIM_CHECK_SECONDS) < 0) {
+			break;
+		}
+	}
+
+	free(owner);
+	free(claim);
+	return ret;
+}
+
+/* The temporary file the owner of the claim on "output" builds it in.
+ * Owners never share one, even when a claim was displaced. Caller frees. */
+char *claim_tmpfile(const char *output)
+{
+	char *owner;
+	char *tmpfile;
+
+	owner = claim_owner();
+	tmpfile = owner_tmpfile(output, owner);
+	free(owner);
+
+	return tmpfile;
+}
+
+/* Whether the claim on "output" is still the caller's, to be checked
+ * before the output is published */
+bool claim_held(const char *output)
+{
+	char *claim;
+	char *owner;
+	char *content;
+	bool held;
+
+	claim = claim_path(output);
+	owner = claim_owner();
+	content = read_claim(claim);
+	held = content && strcmp(content, owner) == 0;
+	free(content);
+	free(owner);
+	free(claim);
+
+	return held;
+}
+
+/* Give up a claim taken by claim_output(), waking up the waiters. A claim
+ * that was lost to another owner is left to that owner. */
+void release_claim(const char *output)
+{
+	char *claim;
+
+	if (!claim_held(output)) {
+		LOG(NULL, "Claim was lost", "%s", output);
+		return;
+	}
+	claim = claim_path(output);
+	if (unlink(claim) != 0) {
+		LOG(NULL, "Failed to release claim", "%s: %s", claim, strerror(errno));
+	}
+	free(claim);
+}
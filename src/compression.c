@@ -0,0 +1,343 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Fullfile compression selection.
+ *
+ * Compressing every fullfile with gzip, xz and bzip2 and throwing two of the
+ * results away triples the cost of the (CPU bound) fullfile phase. Instead
+ * the winner is predicted up front:
+ *  - tiny files and symlinks are dominated by the tar framing, where gzip
+ *    has the smallest container overhead;
+ *  - data that is already compressed does not shrink further, so the
+ *    cheapest compressor is used;
+ *  - files no larger than the samples would be are compressed with every
+ *    type in the one real pass, a trial would compress them in full;
+ *  - everything else gets a trial compression of a few samples, at most
+ *    an eighth of the file, whose ratio is extrapolated to the whole file.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "swupd.h"
+
+/* below this the archive is mostly tar header and padding */
+#define SMALL_FILE_SIZE 512
+#define SAMPLE_SIZE (64 * 1024)
+#define SAMPLE_COUNT 3
+/* trials read at most this fraction of the file */
+#define SAMPLE_FRACTION 8
+/* estimates closer than this (in percent) are both fully compressed */
+#define CLOSE_CALL_PERCENT 3
+
+static int trial_count;
+
+static const struct {
+	const unsigned char *magic;
+	size_t len;
+} compressed_magic[] = {
+	{ (const unsigned char *)"\x1f\x8b", 2 },			/* gzip */
+	{ (const unsigned char *)"\xfd" "7zXZ\x00", 6 },		/* xz */
+	{ (const unsigned char *)"BZh", 3 },				/* bzip2 */
+	{ (const unsigned char *)"\x28\xb5\x2f\xfd", 4 },		/* zstd */
+	{ (const unsigned char *)"\x04\x22\x4d\x18", 4 },		/* lz4 */
+	{ (const unsigned char *)"\x89PNG", 4 },			/* png */
+	{ (const unsigned char *)"\xff\xd8\xff", 3 },			/* jpeg */
+	{ (const unsigned char *)"PK\x03\x04", 4 },			/* zip, jar */
+	{ (const unsigned char *)"hsqs", 4 },				/* squashfs */
+};
+
+const char *file_class_name(enum file_class class)
+{
+	switch (class) {
+	case FILE_CLASS_DATA:
+		return "data";
+	case FILE_CLASS_ELF:
+		return "elf";
+	case FILE_CLASS_TEXT:
+		return "text";
+	case FILE_CLASS_COMPRESSED:
+		return "compressed";
+	case FILE_CLASS_SMALL:
+		return "small";
+	default:
+		assert(0);
+	}
+	return "";
+}
+
+static enum file_class classify_data(const unsigned char *data, size_t len)
+{
+	size_t i;
+	size_t binary = 0;
+
+	if (len >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0) {
+		return FILE_CLASS_ELF;
+	}
+	for (i = 0; i < sizeof(compressed_magic) / sizeof(compressed_magic[0]); i++) {
+		if (len >= compressed_magic[i].len &&
+		    memcmp(data, compressed_magic[i].magic, compressed_magic[i].len) == 0) {
+			return FILE_CLASS_COMPRESSED;
+		}
+	}
+
+	/* text: no NULs and (almost) only printable ASCII, whitespace or UTF-8 */
+	for (i = 0; i < len; i++) {
+		if (data[i] == 0) {
+			return FILE_CLASS_DATA;
+		}
+		if (data[i] < 0x20 && data[i] != '\n' && data[i] != '\r' &&
+		    data[i] != '\t' && data[i] != '\f' && data[i] != 0x1b) {
+			binary++;
+		}
+	}
+	if (binary * 100 > len) {
+		return FILE_CLASS_DATA;
+	}
+	return FILE_CLASS_TEXT;
+}
+
+bool data_is_compressed(const void *data, size_t len)
+{
+	return classify_data(data, len < SMALL_FILE_SIZE ? len : SMALL_FILE_SIZE) == FILE_CLASS_COMPRESSED;
+}
+
+static ssize_t read_at(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < len) {
+		ret = pread(fd, buf + total, len - total, offset + total);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+enum file_class classify_file(const char *path)
+{
+	unsigned char buf[SMALL_FILE_SIZE];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return FILE_CLASS_SMALL;
+	}
+	len = read_at(fd, buf, SMALL_FILE_SIZE, 0);
+	close(fd);
+	if (len < SMALL_FILE_SIZE) {
+		return FILE_CLASS_SMALL;
+	}
+
+	return classify_data(buf, len);
+}
+
+/* Read samples from the start, middle and end of a file larger than
+ * SAMPLE_SIZE * SAMPLE_COUNT. Returns the number of bytes sampled, or -1 on
+ * error. */
+static ssize_t read_samples(int fd, uint64_t size, unsigned char *buf)
+{
+	size_t sample = SAMPLE_SIZE;
+	ssize_t len;
+	ssize_t total = 0;
+	off_t offset;
+	int i;
+
+	if (size / SAMPLE_FRACTION < SAMPLE_SIZE * SAMPLE_COUNT) {
+		sample = size / SAMPLE_FRACTION / SAMPLE_COUNT;
+	}
+
+	for (i = 0; i < SAMPLE_COUNT; i++) {
+		offset = (size - sample) / (SAMPLE_COUNT - 1) * i;
+		len = read_at(fd, buf + total, sample, offset);
+		if (len < 0) {
+			return -1;
+		}
+		total += len;
+	}
+
+	return total;
+}
+
+static void choose_single(struct compression_choice *choice, enum compression_type type)
+{
+	choice->predicted = type;
+	choice->count = 1;
+	choice->types[0] = type;
+}
+
+static void choose_all(struct compression_choice *choice, unsigned long long format)
+{
+	int i;
+
+	choice->predicted = COMPRESSION_TYPES;
+	choice->count = 0;
+	for (i = 0; i < COMPRESSION_TYPES; i++) {
+		if (compression_enabled(i, format)) {
+			choice->types[choice->count++] = i;
+		}
+	}
+}
+
+void compression_choose(const char *path, unsigned long long format, struct compression_choice *choice)
+{
+	unsigned char *buf;
+	uint64_t estimate[COMPRESSION_TYPES];
+	struct compressor *comp;
+	struct stat st = { 0 };
+	ssize_t len;
+	int fd;
+	int i;
+	int best = -1, second = -1;
+	int audit;
+	int ret;
+
+	memset(choice, 0, sizeof(struct compression_choice));
+
+	if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < SMALL_FILE_SIZE) {
+		choice->class = FILE_CLASS_SMALL;
+		choose_single(choice, COMPRESSION_GZIP);
+		if (S_ISREG(st.st_mode) && compression_have_dictionary() &&
+		    compression_enabled(COMPRESSION_ZSTD, format)) {
+			/* a trained dictionary is what makes tiny files
+			 * compress; both are cheap, keep the smaller */
+			choice->predicted = COMPRESSION_ZSTD;
+			choice->types[choice->count++] = COMPRESSION_ZSTD;
+		}
+		return;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		/* let the archiver report the problem */
+		choose_all(choice, format);
+		return;
+	}
+
+	buf = malloc(SAMPLE_SIZE * SAMPLE_COUNT);
+	if (buf == NULL) {
+		assert(0);
+	}
+	len = read_at(fd, buf, SMALL_FILE_SIZE, 0);
+	if (len < SMALL_FILE_SIZE) {
+		close(fd);
+		free(buf);
+		choose_all(choice, format);
+		return;
+	}
+
+	choice->class = classify_data(buf, len);
+	if (choice->class == FILE_CLASS_COMPRESSED) {
+		close(fd);
+		free(buf);
+		choose_single(choice, COMPRESSION_GZIP);
+		return;
+	}
+
+	/* the samples would be the whole file: compressing it with every
+	 * type in the real pass costs the same as the trial and is exact */
+	if (st.st_size <= SAMPLE_SIZE * SAMPLE_COUNT) {
+		close(fd);
+		free(buf);
+		choose_all(choice, format);
+		return;
+	}
+
+	len = read_samples(fd, st.st_size, buf);
+	close(fd);
+	if (len <= 0) {
+		free(buf);
+		choose_all(choice, format);
+		return;
+	}
+
+	/* trial compression, extrapolated to the full size */
+	for (i = 0; i < COMPRESSION_TYPES; i++) {
+		estimate[i] = UINT64_MAX;
+		if (!compression_enabled(i, format)) {
+			continue;
+		}
+		comp = compressor_open(i, NULL);
+		if (!comp) {
+			continue;
+		}
+		compressor_size_hint(comp, st.st_size);
+		ret = compressor_write(comp, buf, len);
+		account_compression_trial(len);
+		if (compressor_close(comp, &estimate[i]) != 0 || ret != 0) {
+			estimate[i] = UINT64_MAX;
+			continue;
+		}
+		estimate[i] = estimate[i] * st.st_size / len;
+	}
+	free(buf);
+
+	for (i = 0; i < COMPRESSION_TYPES; i++) {
+		if (estimate[i] == UINT64_MAX) {
+			continue;
+		}
+		if (best < 0 || estimate[i] < estimate[best]) {
+			second = best;
+			best = i;
+		} else if (second < 0 || estimate[i] < estimate[second]) {
+			second = i;
+		}
+	}
+	if (best < 0) {
+		choose_all(choice, format);
+		return;
+	}
+	choose_single(choice, best);
+
+	audit = config_compression_audit();
+	if (audit > 0 && g_atomic_int_add(&trial_count, 1) % audit == 0) {
+		choose_all(choice, format);
+		choice->predicted = best;
+		return;
+	}
+
+	/* hedge when the runner-up is within CLOSE_CALL_PERCENT */
+	if (second >= 0 &&
+	    (estimate[second] - estimate[best]) * 100 <= estimate[best] * CLOSE_CALL_PERCENT) {
+		choice->count = 2;
+		choice->types[0] = best < second ? best : second;
+		choice->types[1] = best < second ? second : best;
+	}
+}
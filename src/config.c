@@ -44,11 +44,12 @@ char *config_output_dir(void)
 	return g_key_file_get_value(keyfile, "Server", "outputdir", NULL);
 }
 
-char *config_empty_dir(void)
+/* optional: without an object store fullfiles are not shared across versions */
+char *config_object_dir(void)
 {
 	assert(keyfile != NULL);
 
-	return g_key_file_get_value(keyfile, "Server", "emptydir", NULL);
+	return g_key_file_get_value(keyfile, "Server", "objectdir", NULL);
 }
 
 int config_initial_version(void)
@@ -67,6 +68,235 @@ int config_initial_version(void)
 	return version;
 }
 
+/* every Nth predicted fullfile compression is checked against all types,
+ * 0 disables the checks */
+int config_compression_audit(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	int interval;
+
+	c = g_key_file_get_value(keyfile, "Fullfiles", "compressionaudit", NULL);
+
+	if (!c) {
+		return 50;
+	}
+	interval = strtol(c, NULL, 10);
+	free(c);
+	return interval;
+}
+
+/* fullfiles of at least this many bytes are xz compressed in parallel blocks */
+uint64_t config_block_threshold(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	uint64_t threshold;
+
+	c = g_key_file_get_value(keyfile, "Fullfiles", "blockthreshold", NULL);
+
+	if (!c) {
+		return 64 * 1024 * 1024;
+	}
+	threshold = strtoull(c, NULL, 10);
+	free(c);
+	return threshold;
+}
+
+/* most threads one fullfile may use, 0 for one per CPU */
+int config_block_threads(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	int threads;
+
+	c = g_key_file_get_value(keyfile, "Fullfiles", "blockthreads", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	threads = strtol(c, NULL, 10);
+	free(c);
+	return threads;
+}
+
+/* memory the worker pools may use, in MiB; 0 for a share of physical memory */
+uint64_t config_memory_budget(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	uint64_t budget;
+
+	c = g_key_file_get_value(keyfile, "Server", "memorybudget", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	budget = strtoull(c, NULL, 10);
+	free(c);
+	return budget;
+}
+
+/* first format allowed to use zstd, 0 when zstd is not used */
+unsigned long long config_zstd_format(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	unsigned long long zstd_format;
+
+	c = g_key_file_get_value(keyfile, "Server", "zstdformat", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	zstd_format = strtoull(c, NULL, 10);
+	free(c);
+	return zstd_format;
+}
+
+/* first format using the sharded files/ and delta/ layout, 0 for flat */
+unsigned long long config_shard_format(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	unsigned long long shard_format;
+
+	c = g_key_file_get_value(keyfile, "Server", "shardformat", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	shard_format = strtoull(c, NULL, 10);
+	free(c);
+	return shard_format;
+}
+
+/* share (in percent) of the new file that must be found in the old one
+ * for a delta to be tried, 0 tries every delta */
+int config_delta_similarity(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	int similarity;
+
+	c = g_key_file_get_value(keyfile, "Delta", "similarity", NULL);
+
+	if (!c) {
+		return 5;
+	}
+	similarity = strtol(c, NULL, 10);
+	free(c);
+	return similarity;
+}
+
+/* every Nth delta predicted to be useless is made anyway to check the
+ * prediction, 0 disables the checks */
+int config_delta_audit(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	int interval;
+
+	c = g_key_file_get_value(keyfile, "Delta", "predictionaudit", NULL);
+
+	if (!c) {
+		return 50;
+	}
+	interval = strtol(c, NULL, 10);
+	free(c);
+	return interval;
+}
+
+/* first format whose deltas may be made by other engines than bsdiff, 0
+ * for bsdiff only */
+unsigned long long config_delta_engine_format(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	unsigned long long engine_format;
+
+	c = g_key_file_get_value(keyfile, "Delta", "engineformat", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	engine_format = strtoull(c, NULL, 10);
+	free(c);
+	return engine_format;
+}
+
+/* delta engine configured for a class of files ("<class>engine"), or the
+ * default one ("engine") when "class" is NULL; NULL when not configured */
+char *config_delta_engine(const char *class)
+{
+	assert(keyfile != NULL);
+	char *key;
+	char *c;
+
+	string_or_die(&key, "%sengine", class ? class : "");
+	c = g_key_file_get_value(keyfile, "Delta", key, NULL);
+	free(key);
+
+	if (c && c[0] == '\0') {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* first format whose manifest deltas list the changed records instead of
+ * being made with bsdiff, 0 for bsdiff only */
+unsigned long long config_manifest_delta_format(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	unsigned long long manifest_format;
+
+	c = g_key_file_get_value(keyfile, "Delta", "manifestformat", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	manifest_format = strtoull(c, NULL, 10);
+	free(c);
+	return manifest_format;
+}
+
+/* first format whose pack deltas may be made from other files than the
+ * peer, as clients have to find the source by its hash; 0 for never */
+unsigned long long config_delta_source_format(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	unsigned long long source_format;
+
+	c = g_key_file_get_value(keyfile, "Delta", "sourceformat", NULL);
+
+	if (!c) {
+		return 0;
+	}
+	source_format = strtoull(c, NULL, 10);
+	free(c);
+	return source_format;
+}
+
+/* new files of at least this size use the "largeengine" */
+uint64_t config_delta_large_size(void)
+{
+	assert(keyfile != NULL);
+	char *c;
+	uint64_t size;
+
+	c = g_key_file_get_value(keyfile, "Delta", "largesize", NULL);
+
+	if (!c) {
+		return 64 * 1024 * 1024;
+	}
+	size = strtoull(c, NULL, 10);
+	free(c);
+	return size;
+}
+
 bool config_ban_debuginfo(void)
 {
 	assert(keyfile != NULL);
@@ -105,10 +335,6 @@ bool read_configuration_file(char *filename)
 	printf("    output directory : %s\n", c);
 	free(c);
 
-	c = config_empty_dir();
-	printf("    empty  directory : %s\n", c);
-	free(c);
-
 	printf("\n");
 #endif
 	return true;
@@ -578,7 +578,10 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
-	print_elapsed_time("MoM creation", &previous_time, &current_time);
+	/* Step 7b: deltas from the manifests of the previous versions */
+	create_manifest_deltas(new_MoM, manifests_last_versions_list);
+
+	print_elapsed_time("MoM and manifest delta creation", &previous_time, &current_time);
 
 	printf("Entering phase 5: creating download content\n");
 	/* Phase 5: wrapping up */
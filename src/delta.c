@@ -22,25 +22,126 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
-#include <bsdiff.h>
 #include <errno.h>
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "delta.h"
 #include "swupd.h"
 #include "xattrs.h"
 
-void __create_delta(struct file *file, int from_version, char *from_hash)
+/* sources a delta is made from per file, the peer included */
+#define DELTA_SOURCES 3
+
+/* Apply "delta" with "engine" to "original" in memory and check that the result hashes,
+ * with the metadata and xattrs of "newfile", to the known hash of "file". A metadata
+ * record supplies the metadata and xattrs itself, so those are checked as well.
+ * Returns 0 on a match, 1 on a mismatch and -1 if the delta did not apply. */
+static int verify_delta(const struct delta_engine *engine, struct file *file,
+			char *original, char *newfile, char *delta)
 {
-	char *original, *newfile, *outfile, *dotfile, *testnewfile, *conf;
+	struct file check = { 0 };
+	struct stat st;
+	char *xattrs = NULL;
+	size_t xattrs_len = 0;
+	char *target;
+	void *data = NULL;
+	int fd;
 	int ret;
 
-	if (!file->is_file || !file->peer->is_file) {
+	fd = memfd_create("swupd-delta", MFD_CLOEXEC);
+	if (fd < 0) {
+		LOG(file, "Failed to create memfd", "%s", strerror(errno));
+		return -1;
+	}
+
+	/* engines only write to a path; the memfd has one under /proc, which
+	 * also works for an engine running as a child process */
+	string_or_die(&target, "/proc/%i/fd/%i", (int)getpid(), fd);
+	ret = engine->apply(original, target, delta);
+	free(target);
+	if (ret != 0 || fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			LOG(file, "Failed to map delta result", "%s", strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	check.use_xattrs = compute_hash_with_xattrs(newfile);
+	populate_file_struct(&check, newfile);
+	if (strcmp(engine->name, "metadata") == 0) {
+		if (read_metadata_record(delta, &check.stat, &xattrs, &xattrs_len)) {
+			check.stat.st_size = st.st_size;
+			compute_hash_for_metadata(&check, xattrs, xattrs_len, st.st_size > 0 ? data : "", st.st_size);
+			ret = hash_compare(check.hash, file->hash) ? 0 : 1;
+		} else {
+			ret = -1;
+		}
+		free(xattrs);
+	} else {
+		compute_hash_for_data(&check, newfile, st.st_size > 0 ? data : "", st.st_size);
+		ret = hash_compare(check.hash, file->hash) ? 0 : 1;
+	}
+
+	if (data) {
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/* Would make_final_pack ship the delta rather than the fullfile? It gives
+ * deltas a 5% penalty as they are more work for the client. */
+static bool delta_beats_fullfile(const char *outdir, struct file *file, const char *delta)
+{
+	struct stat delta_stat, tar_stat;
+	char *dir, *tarfile;
+	bool ret;
+
+	if (stat(delta, &delta_stat) != 0 || delta_stat.st_size <= 8) {
+		return false;
+	}
+
+	dir = fullfile_dir(outdir, file->last_change, file->hash);
+	string_or_die(&tarfile, "%s/%s.tar", dir, file->hash);
+	free(dir);
+	ret = stat(tarfile, &tar_stat) != 0 || tar_stat.st_size == 0 ||
+	      1.05 * (double)delta_stat.st_size < (double)tar_stat.st_size;
+	free(tarfile);
+
+	return ret;
+}
+
+/* "estimate" is the predictor's estimate for the pair when the caller has
+ * one, NULL otherwise */
+void __create_delta(struct file *file, struct file *from, const struct delta_estimate *estimate)
+{
+	int from_version = from->last_change;
+	char *from_hash = from->hash;
+	char *original, *newfile, *outfile, *dotfile, *conf, *dir;
+	const struct delta_engine *engine;
+	struct stat old_stat, new_stat;
+	uint64_t memory = 0;
+	bool metadata_only;
+	bool xattrs_differ;
+	bool predicted = false;
+	int ret;
+
+	if (!file->is_file || !from->is_file) {
 		return; /* only support deltas between two regular files right now */
 	}
 
@@ -55,88 +156,116 @@ void __create_delta(struct file *file, int from_version, char *from_hash)
 	conf = config_image_base();
 	string_or_die(&newfile, "%s/%i/full/%s", conf, file->last_change, file->filename);
 
-	string_or_die(&original, "%s/%i/full/%s", conf, from_version, file->peer->filename);
+	string_or_die(&original, "%s/%i/full/%s", conf, from_version, from->filename);
 
 	free(conf);
 
 	conf = config_output_dir();
 
-	string_or_die(&outfile, "%s/%i/delta/%i-%i-%s-%s", conf, file->last_change, from_version, file->last_change, from_hash, file->hash);
-	string_or_die(&dotfile, "%s/%i/delta/.%i-%i-%s-%s", conf, file->last_change, from_version, file->last_change, from_hash, file->hash);
-	string_or_die(&testnewfile, "%s/%i/delta/.%i-%i-%s-%s.testnewfile", conf, file->last_change, from_version, file->last_change, from_hash, file->hash);
+	dir = delta_dir(conf, file->last_change, file->hash);
+	string_or_die(&outfile, "%s/%i-%i-%s-%s", dir, from_version, file->last_change, from_hash, file->hash);
+	string_or_die(&dotfile, "%s/.%i-%i-%s-%s", dir, from_version, file->last_change, from_hash, file->hash);
+	free(dir);
 
-	LOG(file, "Making delta", "%s->%s", original, newfile);
+	/* made by an earlier run, which queued the file for another source */
+	if (access(outfile, F_OK) == 0) {
+		goto out;
+	}
+
+	if (lstat(original, &old_stat) != 0 || lstat(newfile, &new_stat) != 0) {
+		LOG(file, "Failed to stat delta input", "%s->%s: %s", original, newfile, strerror(errno));
+		goto out;
+	}
+	/* the hash changed, but with the same content only the mode, owner or
+	 * xattrs can have; the content is only read to rule that out when one
+	 * of them did change, which most changed files do not */
+	xattrs_differ = xattrs_compare(original, newfile) != 0;
+	metadata_only = old_stat.st_size == new_stat.st_size &&
+			(xattrs_differ || old_stat.st_mode != new_stat.st_mode ||
+			 old_stat.st_uid != new_stat.st_uid || old_stat.st_gid != new_stat.st_gid) &&
+			file_content_hash(from, original) && file_content_hash(file, newfile) &&
+			hash_compare(from->content_hash, file->content_hash);
+	engine = delta_engine_choose(newfile, new_stat.st_size, metadata_only);
+	/* older formats cannot take a metadata record */
+	metadata_only = metadata_only && strcmp(engine->name, "metadata") == 0;
 
-	ret = xattrs_compare(original, newfile);
-	if (ret != 0) {
-		LOG(NULL, "xattrs have changed, don't create diff ", "%s", newfile);
+	/* the same pair of contents may have been diffed for another version */
+	if (delta_store_fetch(from_hash, file->hash, engine->name, outfile)) {
+		LOG(file, "Reusing stored delta", "%s-%s", from_hash, file->hash);
 		goto out;
 	}
-	ret = make_bsdiff_delta(original, newfile, dotfile, 0);
+	if (delta_store_is_useless(from_hash, file->hash, engine->name)) {
+		LOG(file, "Known to need a fullfile", "%s-%s", from_hash, file->hash);
+		goto out;
+	}
+
+	LOG(file, "Making delta", "%s->%s with %s", original, newfile, engine->name);
+
+	/* a metadata record is a few lines, nothing to predict */
+	if (!metadata_only) {
+		if (xattrs_differ) {
+			LOG(NULL, "xattrs have changed, don't create diff ", "%s", newfile);
+			delta_store_mark_useless(from_hash, file->hash, engine->name);
+			goto out;
+		}
+		if (!delta_worth_trying(file, original, newfile, estimate, &predicted)) {
+			goto out;
+		}
+	}
+	memory = engine->memory(old_stat.st_size, new_stat.st_size);
+	admit_task(memory, file->hash);
+
+	ret = engine->make(original, newfile, dotfile);
 	if (ret < 0) {
 		LOG(file, "Delta creation failed", "%s->%s ret is %i", original, newfile, ret);
 		goto out;
 	}
-	if (ret == 1) {
+	if (ret == DELTA_TOO_LARGE) {
 		LOG(file, "...delta larger than newfile: FULLDL", "%s", newfile);
 		unlink(dotfile);
+		delta_store_mark_useless(from_hash, file->hash, engine->name);
+		account_delta_prediction(predicted, false);
 		goto out;
 	}
 
 	/* does delta properly recreate expected content? */
-	ret = apply_bsdiff_delta(original, testnewfile, dotfile);
-	if (ret != 0) {
+	ret = verify_delta(engine, file, original, newfile, dotfile);
+	if (ret < 0) {
 		printf("Delta application failed.\n");
-		printf("Attempted %s->%s via diff %s\n", original, testnewfile, dotfile);
-		LOG(file, "Delta application failed.", "Attempted %s->%s via diff %s", original, testnewfile, dotfile);
+		printf("Attempted %s->%s via diff %s\n", original, newfile, dotfile);
+		LOG(file, "Delta application failed.", "Attempted %s->%s via diff %s", original, newfile, dotfile);
 
 #warning the above is racy..tolerate it temporarily
 		// ok fine
-		//unlink(testnewfile);
 		//unlink(dotfile);
 		ret = 0;
 		goto out;
-	}
-	xattrs_copy(original, testnewfile);
-
-	/* does xattrs have been correctly copied?*/
-	if (xattrs_compare(original, testnewfile) != 0) {
-		printf("Delta application resulted in xattrs mismatch.\n");
-		printf("%s->%s via diff %s yielded %s\n", original, newfile, dotfile, testnewfile);
-		LOG(file, "Delta xattrs mismatch:", "%s->%s via diff %s yielded %s", original, newfile, dotfile, testnewfile);
-		assert(0);
-		goto out;
-	}
-
-	char *const sanitycheck[] = { "cmp", "-s", newfile, testnewfile, NULL };
-	ret = system_argv(sanitycheck);
-	if (ret == -1 || ret == 2) {
-		printf("Sanity check system command failed %i. \n", ret);
-		printf("%s->%s via diff %s yielded %s\n", original, newfile, dotfile, testnewfile);
-		assert(0);
-		goto out;
 	} else if (ret == 1) {
-		printf("Delta application resulted in file mismatch %i. \n", ret);
-		printf("%s->%s via diff %s yielded %s\n", original, newfile, dotfile, testnewfile);
-		LOG(file, "Delta mismatch:", "%s->%s via diff %s yielded %s", original, newfile, dotfile, testnewfile);
+		printf("Delta application resulted in hash mismatch.\n");
+		printf("%s->%s via diff %s\n", original, newfile, dotfile);
+		LOG(file, "Delta mismatch:", "%s->%s via diff %s", original, newfile, dotfile);
 
 #warning this too will have failures due to races
-		//unlink(testnewfile);
 		//unlink(dotfile);
 		ret = 0;
 		goto out;
 	}
 
-	unlink(testnewfile);
-
 	if (rename(dotfile, outfile) != 0) {
 		if (errno == ENOENT) {
 			LOG(NULL, "dotfile:", " %s does not exist", dotfile);
 		}
 		LOG(NULL, "Failed to rename", "");
+	} else {
+		delta_store_add(from_hash, file->hash, engine->name, outfile);
+		if (!metadata_only) {
+			account_delta_prediction(predicted, delta_beats_fullfile(conf, file, outfile));
+		}
 	}
 out:
-	free(testnewfile);
+	if (memory) {
+		release_task(memory);
+	}
 	free(conf);
 	free(newfile);
 	free(original);
@@ -144,31 +273,80 @@ out:
 	free(dotfile);
 }
 
-void prepare_delta_dir(struct manifest *manifest)
+struct ranked_source {
+	struct file *file;
+	struct delta_estimate estimate;
+};
+
+static int compare_similarity(const void *a, const void *b)
 {
-	char *path;
-	char *conf;
+	return ((const struct ranked_source *)b)->estimate.similarity -
+	       ((const struct ranked_source *)a)->estimate.similarity;
+}
 
-	printf("Preparing delta directory \n");
+/* Make the delta of "file" from its peer and, if the predictor expects
+ * them to share more with the new content, from up to DELTA_SOURCES - 1
+ * of the other candidate "sources"; make_final_pack ships the smallest.
+ * Each pair is estimated once, for the ranking and the hopeless check. */
+void create_deltas(struct file *file, GList *sources)
+{
+	struct ranked_source *ranked;
+	struct delta_estimate peer;
+	char *conf, *newfile, *original;
+	GList *item;
+	int count = 0;
+	int i;
 
-	conf = config_output_dir();
+	if (!sources) {
+		__create_delta(file, file->peer, NULL);
+		return;
+	}
 
-	string_or_die(&path, "%s/%i", conf, manifest->version);
-	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-		if (errno != EEXIST) {
-			LOG(NULL, "Failed to create directory ", "%s", path);
-			return;
-		}
+	conf = config_image_base();
+	string_or_die(&newfile, "%s/%i/full/%s", conf, file->last_change, file->filename);
+	string_or_die(&original, "%s/%i/full/%s", conf, file->peer->last_change, file->peer->filename);
+	estimate_delta(original, newfile, &peer);
+	free(original);
+	__create_delta(file, file->peer, &peer);
+
+	ranked = calloc(g_list_length(sources), sizeof(struct ranked_source));
+	if (!ranked) {
+		assert(0);
 	}
-	free(path);
-	string_or_die(&path, "%s/%i/delta/", conf, manifest->version);
-	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-		if (errno != EEXIST) {
-			LOG(NULL, "Failed to create directory ", "%s", path);
-			return;
+	for (item = g_list_first(sources); item; item = g_list_next(item)) {
+		ranked[count].file = item->data;
+		string_or_die(&original, "%s/%i/full/%s", conf, ranked[count].file->last_change,
+			      ranked[count].file->filename);
+		estimate_delta(original, newfile, &ranked[count].estimate);
+		free(original);
+		count++;
+	}
+	qsort(ranked, count, sizeof(struct ranked_source), compare_similarity);
+
+	for (i = 0; i < count && i < DELTA_SOURCES - 1; i++) {
+		if (ranked[i].estimate.similarity <= peer.similarity) {
+			break;
 		}
+		LOG(file, "Trying other delta source", "%s (%i%%) instead of %s (%i%%)",
+		    ranked[i].file->filename, ranked[i].estimate.similarity, file->peer->filename,
+		    peer.similarity);
+		__create_delta(file, ranked[i].file, &ranked[i].estimate);
 	}
 
-	free(path);
+	free(ranked);
+	free(newfile);
+	free(conf);
+}
+
+void prepare_delta_dir(struct manifest *manifest)
+{
+	char *conf;
+
+	printf("Preparing delta directory \n");
+
+	delta_engine_set_format(manifest->format);
+
+	conf = config_output_dir();
+	layout_create_dir(conf, manifest->version, manifest->format, "delta");
 	free(conf);
 }
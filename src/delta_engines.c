@@ -0,0 +1,650 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Delta engines.
+ *
+ * bsdiff finds approximate matches, which is what makes it good on
+ * executables whose addresses shift between builds, but its suffix sort
+ * needs about nine times the old file in memory and is slow on large
+ * inputs. Two alternatives can be selected per file class or size:
+ *  - zstd with the old file as prefix ("zstd --patch-from"), which matches
+ *    exact strings over a window covering both files and entropy codes the
+ *    result, fast and frugal on large or text files;
+ *  - xdelta3, a VCDIFF encoder with a rolling hash over the old file, run
+ *    as an external program.
+ * When only the mode, ownership or xattrs of a file changed, the file hash
+ * changes all the same; such files get a metadata record instead.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <bsdiff.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "delta.h"
+#include "swupd.h"
+#include "xattrs.h"
+
+#define MiB (1024 * 1024)
+
+static unsigned long long delta_format;
+
+static bool bsdiff_available(void)
+{
+	return true;
+}
+
+static int bsdiff_make(char *original, char *newfile, char *delta)
+{
+	return make_bsdiff_delta(original, newfile, delta, 0);
+}
+
+static int bsdiff_apply(char *original, char *newfile, char *delta)
+{
+	return apply_bsdiff_delta(original, newfile, delta);
+}
+
+#ifdef SWUPD_WITH_ZSTD
+/* the match finder tables of level 19 and the long distance matcher */
+#define ZSTD_DELTA_TABLES (128 * MiB)
+
+static void *map_file(const char *filename, size_t *len)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	if (*len == 0) {
+		close(fd);
+		return (void *)"";
+	}
+	data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	return data;
+}
+
+static void unmap_file(void *data, size_t len)
+{
+	if (data && len > 0) {
+		munmap(data, len);
+	}
+}
+
+static int write_file(const char *filename, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		return -1;
+	}
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return close(fd);
+}
+
+static bool zstd_available(void)
+{
+	return true;
+}
+
+/* the smallest window reaching from the end of the new file back to the
+ * start of the old one, as far as the format allows */
+static int zstd_window_log(uint64_t size)
+{
+	ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+	int log = bounds.lowerBound;
+
+	while (log < bounds.upperBound && ((uint64_t)1 << log) < size) {
+		log++;
+	}
+	return log;
+}
+
+static int zstd_make(char *original, char *newfile, char *delta)
+{
+	ZSTD_CCtx *cctx;
+	void *old_data, *new_data, *out = NULL;
+	size_t old_size = 0, new_size = 0, bound, len;
+	int window_log;
+	int ret = -1;
+
+	old_data = map_file(original, &old_size);
+	new_data = map_file(newfile, &new_size);
+	if (!old_data || !new_data) {
+		goto out;
+	}
+	if (new_size == 0) {
+		ret = DELTA_TOO_LARGE;
+		goto out;
+	}
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx) {
+		goto out;
+	}
+	window_log = zstd_window_log((uint64_t)old_size + new_size);
+	bound = ZSTD_compressBound(new_size);
+	out = malloc(bound);
+	if (!out) {
+		assert(0);
+	}
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1)) ||
+	    ZSTD_isError(ZSTD_CCtx_refPrefix(cctx, old_data, old_size))) {
+		ZSTD_freeCCtx(cctx);
+		goto out;
+	}
+	if (window_log > ZSTD_LONG_WINDOW_LOG) {
+		/* the regular match finder does not reach that far back */
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+	}
+
+	len = ZSTD_compress2(cctx, out, bound, new_data, new_size);
+	ZSTD_freeCCtx(cctx);
+	if (ZSTD_isError(len)) {
+		LOG(NULL, "zstd delta failed", "%s->%s: %s", original, newfile, ZSTD_getErrorName(len));
+		goto out;
+	}
+	if (len >= new_size) {
+		ret = DELTA_TOO_LARGE;
+		goto out;
+	}
+	ret = write_file(delta, out, len) == 0 ? 0 : -1;
+
+out:
+	free(out);
+	unmap_file(old_data, old_size);
+	unmap_file(new_data, new_size);
+	return ret;
+}
+
+static int zstd_apply(char *original, char *newfile, char *delta)
+{
+	ZSTD_DCtx *dctx;
+	ZSTD_bounds bounds;
+	void *old_data, *delta_data, *out = NULL;
+	size_t old_size = 0, delta_size = 0, len;
+	unsigned long long content_size;
+	int ret = -1;
+
+	old_data = map_file(original, &old_size);
+	delta_data = map_file(delta, &delta_size);
+	if (!old_data || !delta_data) {
+		goto out;
+	}
+
+	content_size = ZSTD_getFrameContentSize(delta_data, delta_size);
+	if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR ||
+	    content_size == 0) {
+		goto out;
+	}
+	out = malloc(content_size);
+	if (!out) {
+		goto out;
+	}
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx) {
+		goto out;
+	}
+	bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+	if (ZSTD_isError(ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, bounds.upperBound)) ||
+	    ZSTD_isError(ZSTD_DCtx_refPrefix(dctx, old_data, old_size))) {
+		ZSTD_freeDCtx(dctx);
+		goto out;
+	}
+	len = ZSTD_decompressDCtx(dctx, out, content_size, delta_data, delta_size);
+	ZSTD_freeDCtx(dctx);
+	if (ZSTD_isError(len) || len != content_size) {
+		goto out;
+	}
+	ret = write_file(newfile, out, len) == 0 ? 0 : -1;
+
+out:
+	free(out);
+	unmap_file(old_data, old_size);
+	unmap_file(delta_data, delta_size);
+	return ret;
+}
+
+/* both inputs are mapped and the output buffered */
+static uint64_t zstd_memory(uint64_t old_size, uint64_t new_size)
+{
+	return old_size + 2 * new_size + ZSTD_DELTA_TABLES;
+}
+#else
+static bool zstd_available(void)
+{
+	return false;
+}
+
+static int zstd_make(__unused__ char *original, __unused__ char *newfile, __unused__ char *delta)
+{
+	return -1;
+}
+
+static int zstd_apply(__unused__ char *original, __unused__ char *newfile, __unused__ char *delta)
+{
+	return -1;
+}
+
+static uint64_t zstd_memory(uint64_t old_size, uint64_t new_size)
+{
+	return old_size + new_size;
+}
+#endif
+
+/* xdelta3 defaults to a 64 MiB source window; beyond that it only finds
+ * matches near the current position */
+#define XDELTA_MIN_WINDOW (64 * MiB)
+#define XDELTA_MAX_WINDOW (1024 * MiB)
+
+static bool xdelta_available(void)
+{
+	static gsize available = 0;
+	char *path;
+
+	if (g_once_init_enter(&available)) {
+		path = g_find_program_in_path("xdelta3");
+		g_once_init_leave(&available, path ? 2 : 1);
+		g_free(path);
+	}
+	return available == 2;
+}
+
+static int xdelta_make(char *original, char *newfile, char *delta)
+{
+	struct stat old_stat, new_stat, delta_stat;
+	uint64_t window;
+	char *window_arg;
+	int ret;
+
+	if (stat(original, &old_stat) != 0 || stat(newfile, &new_stat) != 0) {
+		return -1;
+	}
+	window = old_stat.st_size;
+	if (window < XDELTA_MIN_WINDOW) {
+		window = XDELTA_MIN_WINDOW;
+	} else if (window > XDELTA_MAX_WINDOW) {
+		window = XDELTA_MAX_WINDOW;
+	}
+	string_or_die(&window_arg, "%llu", (unsigned long long)window);
+
+	/* no secondary compression, so any VCDIFF decoder can apply it */
+	char *const xdeltacmd[] = { "xdelta3", "-e", "-9", "-f", "-S", "none", "-B", window_arg,
+				    "-s", original, newfile, delta, NULL };
+	ret = system_argv(xdeltacmd);
+	free(window_arg);
+	if (ret != 0) {
+		return -1;
+	}
+
+	if (stat(delta, &delta_stat) != 0) {
+		return -1;
+	}
+	if (delta_stat.st_size >= new_stat.st_size) {
+		return DELTA_TOO_LARGE;
+	}
+	return 0;
+}
+
+static int xdelta_apply(char *original, char *newfile, char *delta)
+{
+	char *const xdeltacmd[] = { "xdelta3", "-d", "-f", "-s", original, delta, newfile, NULL };
+
+	return system_argv(xdeltacmd);
+}
+
+/* the source window, the input window and the hash tables */
+static uint64_t xdelta_memory(uint64_t old_size, uint64_t new_size)
+{
+	if (old_size > XDELTA_MAX_WINDOW) {
+		old_size = XDELTA_MAX_WINDOW;
+	}
+	return old_size + new_size + XDELTA_MIN_WINDOW;
+}
+
+#define METADATA_MAGIC "SWUPD-METADATA\t1\n"
+
+static bool metadata_available(void)
+{
+	return true;
+}
+
+static void write_xattr(const char *name, const char *value, size_t value_len, void *data)
+{
+	FILE *out = data;
+
+	fprintf(out, "xattr:\t%s\t%zu\n", name, value_len);
+	fwrite(value, 1, value_len, out);
+	fputc('\n', out);
+}
+
+/* The new mode, ownership and xattrs; the content is the old one */
+static int metadata_make(__unused__ char *original, char *newfile, char *delta)
+{
+	struct stat st;
+	FILE *out;
+
+	if (lstat(newfile, &st) != 0) {
+		return -1;
+	}
+	out = fopen(delta, "w");
+	if (!out) {
+		return -1;
+	}
+	fputs(METADATA_MAGIC, out);
+	fprintf(out, "mode:\t%o\n", (unsigned int)(st.st_mode & 07777));
+	fprintf(out, "uid:\t%u\n", (unsigned int)st.st_uid);
+	fprintf(out, "gid:\t%u\n", (unsigned int)st.st_gid);
+	xattrs_for_each(newfile, write_xattr, out);
+
+	return fclose(out) == 0 ? 0 : -1;
+}
+
+/* Parse a metadata record, calling "callback" for each xattr in it.
+ * Returns false if the record is malformed. */
+static bool parse_metadata(const char *content, size_t len, unsigned int *mode, unsigned int *uid,
+			   unsigned int *gid, xattrs_callback_t callback, void *data)
+{
+	const char *p, *end = content + len;
+	const char *name, *tab;
+	char *next;
+	char *attr;
+	unsigned long long value_len;
+	int consumed = 0;
+
+	if (len < strlen(METADATA_MAGIC) || strncmp(content, METADATA_MAGIC, strlen(METADATA_MAGIC)) != 0) {
+		return false;
+	}
+	p = content + strlen(METADATA_MAGIC);
+	if (sscanf(p, "mode:\t%o\nuid:\t%u\ngid:\t%u%n", mode, uid, gid, &consumed) != 3 ||
+	    p[consumed] != '\n') {
+		return false;
+	}
+	p += consumed + 1;
+
+	/* values are binary, so their lengths are what delimits them */
+	while (p < end) {
+		if ((size_t)(end - p) < strlen("xattr:\t") || strncmp(p, "xattr:\t", strlen("xattr:\t")) != 0) {
+			return false;
+		}
+		name = p + strlen("xattr:\t");
+		tab = memchr(name, '\t', end - name);
+		if (!tab || tab == name) {
+			return false;
+		}
+		errno = 0;
+		value_len = strtoull(tab + 1, &next, 10);
+		if (errno || next == tab + 1 || next >= end || *next != '\n') {
+			return false;
+		}
+		p = next + 1;
+		if (value_len >= (unsigned long long)(end - p) || p[value_len] != '\n') {
+			return false;
+		}
+		attr = g_strndup(name, tab - name);
+		callback(attr, p, value_len, data);
+		free(attr);
+		p += value_len + 1;
+	}
+	return true;
+}
+
+struct xattr_target {
+	int fd;
+	const char *filename;
+};
+
+static void set_xattr(const char *name, const char *value, size_t value_len, void *data)
+{
+	struct xattr_target *target = data;
+
+	/* needs privileges the verification may lack */
+	if (fsetxattr(target->fd, name, value, value_len, 0) != 0) {
+		LOG(NULL, "Failed to set xattr", "%s: %s", target->filename, name);
+	}
+}
+
+static void skip_xattr(__unused__ const char *name, __unused__ const char *value,
+		       __unused__ size_t value_len, __unused__ void *data)
+{
+}
+
+static int metadata_apply(char *original, char *newfile, char *delta)
+{
+	struct xattr_target target = { -1, newfile };
+	char *content = NULL;
+	unsigned int mode, uid, gid;
+	gsize len = 0;
+	int in = -1;
+	char buf[128 * 1024];
+	ssize_t n;
+	int ret = -1;
+
+	if (!g_file_get_contents(delta, &content, &len, NULL) ||
+	    !parse_metadata(content, len, &mode, &uid, &gid, skip_xattr, NULL)) {
+		goto out;
+	}
+
+	in = open(original, O_RDONLY | O_CLOEXEC);
+	target.fd = open(newfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (in < 0 || target.fd < 0) {
+		goto out;
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(target.fd, buf, n) != n) {
+			goto out;
+		}
+	}
+	if (n < 0 || fchmod(target.fd, mode) != 0) {
+		goto out;
+	}
+	if (fchown(target.fd, uid, gid) != 0) {
+		LOG(NULL, "Failed to change owner", "%s", newfile);
+	}
+	parse_metadata(content, len, &mode, &uid, &gid, set_xattr, &target);
+	ret = 0;
+
+out:
+	if (in >= 0) {
+		close(in);
+	}
+	if (target.fd >= 0 && close(target.fd) != 0) {
+		ret = -1;
+	}
+	free(content);
+	return ret;
+}
+
+/* the blob of xattrs_get_blob(): the names, each with its terminating
+ * null, followed by the values, each null terminated unless empty */
+struct xattr_blob {
+	FILE *names;
+	FILE *values;
+};
+
+static void add_xattr(const char *name, const char *value, size_t value_len, void *data)
+{
+	struct xattr_blob *blob = data;
+
+	fwrite(name, 1, strlen(name) + 1, blob->names);
+	fwrite(value, 1, value_len, blob->values);
+	if (value_len > 0 && value[value_len - 1] != '\0') {
+		fputc('\0', blob->values);
+	}
+}
+
+bool read_metadata_record(const char *delta, struct update_stat *stat, char **xattrs, size_t *xattrs_len)
+{
+	struct xattr_blob blob;
+	char *names = NULL, *values = NULL;
+	size_t names_len = 0, values_len = 0;
+	char *content = NULL;
+	unsigned int mode, uid, gid;
+	gsize len = 0;
+	bool ret;
+
+	*xattrs = NULL;
+	*xattrs_len = 0;
+	if (!g_file_get_contents(delta, &content, &len, NULL)) {
+		return false;
+	}
+
+	blob.names = open_memstream(&names, &names_len);
+	blob.values = open_memstream(&values, &values_len);
+	if (!blob.names || !blob.values) {
+		assert(0);
+	}
+	ret = parse_metadata(content, len, &mode, &uid, &gid, add_xattr, &blob);
+	fclose(blob.names);
+	fclose(blob.values);
+	free(content);
+
+	if (ret) {
+		stat->st_mode = S_IFREG | mode;
+		stat->st_uid = uid;
+		stat->st_gid = gid;
+		if (names_len > 0) {
+			*xattrs = realloc(names, names_len + values_len);
+			if (!*xattrs) {
+				assert(0);
+			}
+			memcpy(*xattrs + names_len, values, values_len);
+			*xattrs_len = names_len + values_len;
+			names = NULL;
+		}
+	}
+	free(names);
+	free(values);
+	return ret;
+}
+
+static uint64_t metadata_memory(__unused__ uint64_t old_size, __unused__ uint64_t new_size)
+{
+	return MiB;
+}
+
+static const struct delta_engine metadata_engine = {
+	"metadata", metadata_available, metadata_make, metadata_apply, metadata_memory
+};
+
+/* the first one is the default */
+static const struct delta_engine engines[] = {
+	{ "bsdiff", bsdiff_available, bsdiff_make, bsdiff_apply, estimate_delta_memory },
+	{ "zstd", zstd_available, zstd_make, zstd_apply, zstd_memory },
+	{ "xdelta", xdelta_available, xdelta_make, xdelta_apply, xdelta_memory },
+};
+
+void delta_engine_set_format(unsigned long long format)
+{
+	delta_format = format;
+}
+
+const struct delta_engine *delta_engine_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		if (strcmp(engines[i].name, name) == 0) {
+			return &engines[i];
+		}
+	}
+	return NULL;
+}
+
+const struct delta_engine *delta_engine_choose(const char *newfile, uint64_t new_size, bool metadata_only)
+{
+	const struct delta_engine *engine;
+	unsigned long long engine_format;
+	uint64_t large_size;
+	char *name = NULL;
+
+	engine_format = config_delta_engine_format();
+	if (engine_format == 0 || delta_format < engine_format) {
+		return &engines[0];
+	}
+	if (metadata_only) {
+		return &metadata_engine;
+	}
+
+	large_size = config_delta_large_size();
+	if (large_size > 0 && new_size >= large_size) {
+		name = config_delta_engine("large");
+	}
+	if (!name) {
+		name = config_delta_engine(file_class_name(classify_file(newfile)));
+	}
+	if (!name) {
+		name = config_delta_engine(NULL);
+	}
+	if (!name) {
+		return &engines[0];
+	}
+
+	engine = delta_engine_find(name);
+	if (!engine) {
+		LOG(NULL, "Unknown delta engine, using bsdiff", "%s", name);
+		engine = &engines[0];
+	} else if (!engine->available()) {
+		LOG(NULL, "Delta engine not available, using bsdiff", "%s", name);
+		engine = &engines[0];
+	}
+	free(name);
+
+	return engine;
+}
@@ -23,10 +23,10 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
-#include <libgen.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,38 +35,333 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive.h"
 #include "swupd.h"
 
+/* Very large files would otherwise keep a single thread busy long after the
+ * rest of the pool ran out of work. They are xz compressed with several
+ * encoder threads instead. Every fullfile task holds one of the pool's
+ * slots while it runs, and a large file takes whatever extra slots are idle
+ * for its encoder threads; other tasks wait for a free slot, so the CPUs
+ * are not oversubscribed while more files are still queued. */
+static int free_slots;
+static GMutex slot_lock;
+static GCond slot_cond;
+
+static void acquire_slot(void)
+{
+	g_mutex_lock(&slot_lock);
+	while (free_slots < 1) {
+		g_cond_wait(&slot_cond, &slot_lock);
+	}
+	free_slots--;
+	g_mutex_unlock(&slot_lock);
+}
+
+static void release_slots(int count)
+{
+	g_mutex_lock(&slot_lock);
+	free_slots += count;
+	g_cond_broadcast(&slot_cond);
+	g_mutex_unlock(&slot_lock);
+}
+
+/* encoder threads worth using for a large file */
+static int block_threads_wanted(uint64_t size)
+{
+	uint64_t block = 3 * 8 * 1024 * 1024; /* xz -6 block size */
+	int wanted = config_block_threads();
+
+	if (wanted <= 0) {
+		wanted = num_threads(1.0);
+	}
+	if ((uint64_t)wanted > (size + block - 1) / block) {
+		wanted = (size + block - 1) / block;
+	}
+
+	return wanted;
+}
+
+/* take idle slots for a large file's encoder threads, without waiting */
+static int borrow_slots(int wanted)
+{
+	int granted;
+
+	g_mutex_lock(&slot_lock);
+	granted = free_slots < wanted - 1 ? free_slots : wanted - 1;
+	if (granted < 0) {
+		granted = 0;
+	}
+	free_slots -= granted;
+	g_mutex_unlock(&slot_lock);
+
+	return granted;
+}
+
+/* format of the version being produced, decides whether zstd may be used */
+static unsigned long long fullfile_format;
+
+/* Completed fullfiles are recorded in <outputdir>/<version>/.fullfiles.journal,
+ * one hash per line, appended with a single write() once the final
+ * files/<hash>.tar is in place. Outputs are built under dot-prefixed
+ * temporary names and renamed, so after a crash the only leftovers are
+ * dot-files, which are removed before the next run. A rerun skips the
+ * journaled hashes without looking at the files; only versions without a
+ * journal fall back to checking each output for existence. The journal is
+ * deleted when a run finishes, so it never outlives the outputs it vouches
+ * for. */
+static GHashTable *journal;
+static char *journal_path;
+static int journal_fd = -1;
+static bool use_journal;
+
+static void journal_append(const char *hash)
+{
+	char line[SWUPD_HASH_LEN + 1];
+
+	if (journal_fd < 0) {
+		return;
+	}
+	snprintf(line, sizeof(line), "%s\n", hash);
+	if (write(journal_fd, line, SWUPD_HASH_LEN) != SWUPD_HASH_LEN) {
+		LOG(NULL, "Failed to write fullfile journal", "%s", strerror(errno));
+	}
+}
+
+/* returns true if the journal existed */
+static bool journal_open(const char *outdir, int version)
+{
+	char *path;
+	gchar *contents = NULL;
+	gsize len = 0;
+	gchar **lines;
+	bool existed;
+	int i;
+
+	string_or_die(&journal_path, "%s/%i/.fullfiles.journal", outdir, version);
+	path = journal_path;
+	existed = g_file_get_contents(path, &contents, &len, NULL);
+	journal = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (existed) {
+		lines = g_strsplit(contents, "\n", -1);
+		/* the last element follows the final newline: empty, or torn */
+		for (i = 0; lines[i] && lines[i + 1]; i++) {
+			if (strlen(lines[i]) == SWUPD_HASH_LEN - 1) {
+				g_hash_table_add(journal, g_strdup(lines[i]));
+			}
+		}
+		g_strfreev(lines);
+	}
+
+	journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (journal_fd < 0) {
+		LOG(NULL, "Failed to open fullfile journal", "%s: %s", path, strerror(errno));
+	} else if (len > 0 && contents[len - 1] != '\n') {
+		/* terminate a torn last record so the next one stands alone */
+		if (write(journal_fd, "\n", 1) != 1) {
+			LOG(NULL, "Failed to write fullfile journal", "%s", strerror(errno));
+		}
+	}
+	LOG(NULL, "Fullfile journal", "%s: %u completed entries", path, g_hash_table_size(journal));
+
+	g_free(contents);
+	return existed;
+}
+
+/* the run is over: a rerun checks the outputs themselves, which also
+ * catches any removed since */
+static void journal_close(void)
+{
+	if (journal_fd >= 0) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	if (unlink(journal_path) != 0 && errno != ENOENT) {
+		LOG(NULL, "Failed to remove fullfile journal", "%s: %s", journal_path, strerror(errno));
+	}
+	g_hash_table_destroy(journal);
+	journal = NULL;
+	free(journal_path);
+	journal_path = NULL;
+}
+
+/* remove temporary outputs left behind by an interrupted run, descending
+ * into the shards of a sharded version */
+static void remove_partial_outputs_in(const char *dirpath, bool sharded)
+{
+	char *path;
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir(dirpath);
+	if (!dir) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		string_or_die(&path, "%s/%s", dirpath, entry->d_name);
+		if (entry->d_name[0] == '.') {
+			LOG(NULL, "Removing partial fullfile", "%s", path);
+			unlink(path);
+		} else if (sharded && strlen(entry->d_name) == 2) {
+			remove_partial_outputs_in(path, false);
+		}
+		free(path);
+	}
+	closedir(dir);
+}
+
+static void remove_partial_outputs(const char *outdir, int version)
+{
+	char *dirpath;
+
+	string_or_die(&dirpath, "%s/%i/files", outdir, version);
+	remove_partial_outputs_in(dirpath, version_is_sharded(outdir, version));
+	free(dirpath);
+}
+
+/* Small files compress poorly on their own, so when zstd is allowed a
+ * dictionary is trained on the small files of this version and shipped as
+ * <outputdir>/<version>/zstd.dict; small fullfiles compressed with zstd
+ * need it to be decompressed. An existing dictionary is reused, so a
+ * resumed run stays consistent with the fullfiles already written. */
+#define DICTIONARY_SAMPLES_MAX (100 * DICTIONARY_SIZE)
+#define DICTIONARY_SAMPLES_MIN 16
+
+static void prepare_dictionary(GList *files, const char *outdir, int version)
+{
+	char *path, *origin, *indir;
+	gchar *data = NULL;
+	gsize len = 0;
+	char *samples = NULL;
+	size_t *sizes = NULL;
+	size_t total = 0;
+	unsigned int count = 0;
+	unsigned int allocated = 0;
+	void *dict = NULL;
+	size_t dict_len;
+	struct stat sbuf;
+	struct file *file;
+	GList *item;
+
+	if (!compression_enabled(COMPRESSION_ZSTD, fullfile_format)) {
+		return;
+	}
+
+	string_or_die(&path, "%s/%i/zstd.dict", outdir, version);
+	if (g_file_get_contents(path, &data, &len, NULL)) {
+		if (compression_use_dictionary(data, len)) {
+			LOG(NULL, "Reusing zstd dictionary", "%s", path);
+		}
+		g_free(data);
+		free(path);
+		return;
+	}
+
+	indir = config_image_base();
+	for (item = files; item && total < DICTIONARY_SAMPLES_MAX; item = g_list_next(item)) {
+		file = item->data;
+		if (!file->is_file || file->is_ghosted) {
+			continue;
+		}
+		string_or_die(&origin, "%s/%i/full/%s", indir, file->last_change, file->filename);
+		if (lstat(origin, &sbuf) != 0 || !S_ISREG(sbuf.st_mode) || sbuf.st_size == 0 ||
+		    sbuf.st_size > DICTIONARY_FILE_MAX ||
+		    !g_file_get_contents(origin, &data, &len, NULL)) {
+			free(origin);
+			continue;
+		}
+		free(origin);
+
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			sizes = realloc(sizes, allocated * sizeof(size_t));
+			if (!sizes) {
+				assert(0);
+			}
+		}
+		samples = realloc(samples, total + len);
+		if (!samples) {
+			assert(0);
+		}
+		memcpy(samples + total, data, len);
+		sizes[count++] = len;
+		total += len;
+		g_free(data);
+	}
+	free(indir);
+
+	if (count < DICTIONARY_SAMPLES_MIN) {
+		LOG(NULL, "Not enough small files for a zstd dictionary", "%u samples", count);
+		goto out;
+	}
+
+	dict = malloc(DICTIONARY_SIZE);
+	if (!dict) {
+		assert(0);
+	}
+	dict_len = compression_train_dictionary(dict, DICTIONARY_SIZE, samples, sizes, count);
+	if (dict_len == 0) {
+		goto out;
+	}
+	/* written to a temporary file and renamed into place */
+	if (!g_file_set_contents(path, dict, dict_len, NULL)) {
+		LOG(NULL, "Failed to write zstd dictionary", "%s", path);
+		goto out;
+	}
+	compression_use_dictionary(dict, dict_len);
+	LOG(NULL, "Trained zstd dictionary", "%s: %zu bytes from %u files (%zu bytes)", path, dict_len, count, total);
+
+out:
+	free(dict);
+	free(samples);
+	free(sizes);
+	free(path);
+}
+
+/* The object store key of a fullfile. Files small enough for the zstd
+ * dictionary may be compressed with it, and clients can only decompress
+ * them with the dictionary of the same version, so their key also names
+ * the dictionary; each version trains its own. Caller frees. */
+static char *fullfile_object_key(struct file *file, const struct stat *sbuf)
+{
+	char *key;
+
+	if (file->is_dir || !compression_have_dictionary() || sbuf->st_size > DICTIONARY_FILE_MAX) {
+		return strdup(file->hash);
+	}
+	string_or_die(&key, "%s.dict-%08x", file->hash, compression_dictionary_id());
+	return key;
+}
+
 /* output must be a file, which is a (compressed) tar file, of the file denoted by "file", without any of its
    directory paths etc etc */
 static void create_fullfile(struct file *file)
 {
-	char *origin;
+	char *origin = NULL;
 	char *tarname = NULL;
-	char *rename_source = NULL;
-	char *rename_target = NULL;
-	char *rename_tmpdir = NULL;
+	char *key = NULL;
 	int ret;
 	struct stat sbuf;
-	char *empty, *indir, *outdir;
-	char *param1, *param2;
+	char *indir, *outdir, *dir;
 
 	if (file->is_deleted) {
 		return; /* file got deleted -> by definition we cannot tar it up */
 	}
 
-	empty = config_empty_dir();
 	indir = config_image_base();
 	outdir = config_output_dir();
+	dir = fullfile_dir(outdir, file->last_change, file->hash);
 
-	string_or_die(&tarname, "%s/%i/files/%s.tar", outdir, file->last_change, file->hash);
-	if (access(tarname, R_OK) == 0) {
+	string_or_die(&tarname, "%s/%s.tar", dir, file->hash);
+	if (!use_journal && access(tarname, R_OK) == 0) {
 		/* output file already exists...done */
+		journal_append(file->hash);
 		free(tarname);
-		return;
+		goto out;
 	}
-	free(tarname);
-	//printf("%s was missing\n", file->hash);
 
 	string_or_die(&origin, "%s/%i/full/%s", indir, file->last_change, file->filename);
 	if (lstat(origin, &sbuf) < 0) {
@@ -75,163 +370,232 @@ static void create_fullfile(struct file *file)
 		assert(0);
 	}
 
-	if (file->is_dir) { /* directories are easy */
-		char *tmp1, *tmp2, *dir, *base;
+	key = fullfile_object_key(file, &sbuf);
+	if (object_store_fetch(key, tarname)) {
+		/* same content was published before...reuse it */
+		LOG(file, "Reusing stored fullfile", "%s", key);
+		journal_append(file->hash);
+		free(tarname);
+		goto out;
+	}
+	free(tarname);
+	//printf("%s was missing\n", file->hash);
 
-		tmp1 = strdup(origin);
-		assert(tmp1);
-		base = basename(tmp1);
+	if (file->is_dir) { /* directories are easy */
+		struct compressor *comp;
 
-		tmp2 = strdup(origin);
-		assert(tmp2);
-		dir = dirname(tmp2);
+		/* a directory fullfile is a single header carrying the metadata
+		 * and xattrs, simply gzip compressed */
+		char *tmpname;
 
-		string_or_die(&rename_tmpdir, "%s/XXXXXX", outdir);
-		if (!mkdtemp(rename_tmpdir)) {
-			LOG(NULL, "Failed to create temporary directory for %s move", origin);
+		string_or_die(&tmpname, "%s/.%s.tar", dir, file->hash);
+		string_or_die(&tarname, "%s/%s.tar", dir, file->hash);
+		comp = compressor_open(COMPRESSION_GZIP, tmpname);
+		if (!comp) {
 			assert(0);
 		}
-
-		string_or_die(&param1, "--exclude=%s/?*", base);
-		string_or_die(&param2, "./%s", base);
-		char *const tarcfcmd[] = { TAR_COMMAND, "-C", dir, TAR_PERM_ATTR_ARGS_STRLIST, "-cf", "-", param1, param2, NULL };
-		char *const tarxfcmd[] = { TAR_COMMAND, "-C", rename_tmpdir, TAR_PERM_ATTR_ARGS_STRLIST, "-xf", "-", NULL };
-
-		int tarcmdresult = system_argv_pipe(tarcfcmd, tarxfcmd);
-		if (tarcmdresult != 0) {
-			LOG(NULL, "Tar command for copying directory full file failed with code %d", tarcmdresult);
+		ret = tar_write_member(origin, file->hash, &comp, 1);
+		if (compressor_close(comp, NULL) != 0 || ret != 0) {
+			LOG(file, "Failed to create directory fullfile", "%s", origin);
 			assert(0);
 		}
-		free(param1);
-		free(param2);
-
-		string_or_die(&rename_source, "%s/%s", rename_tmpdir, base);
-		string_or_die(&rename_target, "%s/%s", rename_tmpdir, file->hash);
-		if (rename(rename_source, rename_target)) {
-			LOG(NULL, "rename failed for %s to %s", rename_source, rename_target);
-			assert(0);
+		if (rename(tmpname, tarname) != 0) {
+			LOG(file, "post-tar rename failed", "%s", strerror(errno));
+		} else {
+			object_store_add(key, tarname);
+			journal_append(file->hash);
 		}
-		free(rename_source);
-
-		/* for a directory file, tar up simply with gzip */
-		string_or_die(&param1, "%s/%i/files/%s.tar", outdir, file->last_change, file->hash);
-		char *const tarcmd[] = { TAR_COMMAND, "-C", rename_tmpdir, TAR_PERM_ATTR_ARGS_STRLIST, "-zcf", param1, file->hash, NULL };
-
-		if (system_argv(tarcmd) != 0) {
-			assert(0);
+		free(tmpname);
+		free(tarname);
+	} else { /* files are more complex */
+		struct compression_choice choice;
+		struct compressor *comp[COMPRESSION_TYPES];
+		char *compfile[COMPRESSION_TYPES];
+		uint64_t size[COMPRESSION_TYPES];
+		int count;
+		int best = -1;
+		int threads = 1;
+		int wanted = 1;
+		uint64_t memory = 0;
+		bool large;
+		enum compression_type parallel_type;
+		int i;
+
+		/* wait until the encoders fit in the memory budget; the estimate
+		 * covers every type since the trial compression may use them */
+		large = S_ISREG(sbuf.st_mode) && (uint64_t)sbuf.st_size >= config_block_threshold();
+		parallel_type = compression_enabled(COMPRESSION_ZSTD, fullfile_format) ? COMPRESSION_ZSTD : COMPRESSION_XZ;
+		if (large) {
+			wanted = block_threads_wanted(sbuf.st_size);
 		}
-		free(param1);
-
-		if (rmdir(rename_target)) {
-			LOG(NULL, "rmdir failed for %s", rename_target);
+		for (i = 0; i < COMPRESSION_TYPES; i++) {
+			if (compression_enabled(i, fullfile_format)) {
+				memory += compressor_memusage(i, i == (int)parallel_type ? wanted : 1, sbuf.st_size);
+			}
 		}
-		free(rename_target);
-		if (rmdir(rename_tmpdir)) {
-			LOG(NULL, "rmdir failed for %s", rename_tmpdir);
+		admit_task(memory, file->hash);
+
+		/* step 1: predict which compression types can win */
+		compression_choose(origin, fullfile_format, &choice);
+		count = choice.count;
+
+		/* very large files: a single multi-threaded compression (zstd
+		 * when the format allows it, else xz), unless they are known
+		 * not to compress */
+		if (large) {
+			for (i = 0; i < count; i++) {
+				if (choice.types[i] == COMPRESSION_XZ || choice.types[i] == COMPRESSION_ZSTD) {
+					choice.types[0] = parallel_type;
+					count = 1;
+					threads += borrow_slots(wanted);
+					LOG(file, "Parallel compression", "%s%s: %lld bytes, %d threads",
+					    file->hash, compression_suffix(parallel_type),
+					    (long long)sbuf.st_size, threads);
+					break;
+				}
+			}
 		}
-		free(rename_tmpdir);
 
-		free(tmp1);
-		free(tmp2);
-	} else { /* files are more complex */
-		char *gzfile = NULL, *bzfile = NULL, *xzfile = NULL;
-		char *tempfile;
-		uint64_t gz_size = LONG_MAX, bz_size = LONG_MAX, xz_size = LONG_MAX;
-
-		/* step 1: hardlink the guy to an empty directory with the hash as the filename */
-		string_or_die(&tempfile, "%s/%s", empty, file->hash);
-		if (link(origin, tempfile) < 0) {
-			LOG(NULL, "hardlink failed", "%s due to %s (%s -> %s)", file->filename, strerror(errno), origin, tempfile);
-			char *const argv[] = { "cp", "-a", origin, tempfile, NULL };
-			if (system_argv(argv) != 0) {
+		/* step 2: tar it with those compression types in a single pass, the
+		 * member is named after the hash so no staging copy is needed */
+		for (i = 0; i < count; i++) {
+			string_or_die(&compfile[i], "%s/.%s.tar%s", dir, file->hash,
+				      compression_suffix(choice.types[i]));
+			comp[i] = compressor_open_threads(choice.types[i], compfile[i], threads);
+			if (!comp[i]) {
 				assert(0);
 			}
+			compressor_size_hint(comp[i], sbuf.st_size);
 		}
 
-		/* step 2a: tar it with each compression type  */
-		// lzma
-		string_or_die(&param1, "--directory=%s", empty);
-		string_or_die(&param2, "%s/%i/files/%s.tar.xz", outdir, file->last_change, file->hash);
-		char *const tarlzmacmd[] = { TAR_COMMAND, param1, TAR_PERM_ATTR_ARGS_STRLIST, "-Jcf", param2, file->hash, NULL };
-
-		if (system_argv(tarlzmacmd) != 0) {
-			assert(0);
-		}
-		free(param1);
-		free(param2);
-
-		// gzip
-		string_or_die(&param1, "--directory=%s", empty);
-		string_or_die(&param2, "%s/%i/files/%s.tar.gz", outdir, file->last_change, file->hash);
-		char *const targzipcmd[] = { TAR_COMMAND, param1, TAR_PERM_ATTR_ARGS_STRLIST, "-zcf", param2, file->hash, NULL };
-
-		if (system_argv(targzipcmd) != 0) {
-			assert(0);
+		ret = tar_write_member(origin, file->hash, comp, count);
+		for (i = 0; i < count; i++) {
+			if (compressor_close(comp[i], &size[i]) != 0) {
+				ret = -1;
+			}
 		}
-		free(param1);
-		free(param2);
-
-#ifdef SWUPD_WITH_BZIP2
-		string_or_die(&param1, "--directory=%s", empty);
-		string_or_die(&param2, "%s/%i/files/%s.tar.bz2", outdir, file->last_change, file->hash);
-		char *const tarbzip2cmd[] = { TAR_COMMAND, param1, TAR_PERM_ATTR_ARGS_STRLIST, "-jcf", param2, file->hash, NULL };
-
-		if (system_argv(tarbzip2cmd) != 0) {
+		release_slots(threads - 1);
+		release_task(memory);
+		if (ret != 0) {
+			LOG(file, "Failed to create fullfile tar", "%s", origin);
 			assert(0);
 		}
-		free(param1);
-		free(param2);
 
-#endif
-
-		/* step 2b: pick the smallest of the three compression formats */
-		string_or_die(&gzfile, "%s/%i/files/%s.tar.gz", outdir, file->last_change, file->hash);
-		if (stat(gzfile, &sbuf) == 0) {
-			gz_size = sbuf.st_size;
-		}
-		string_or_die(&bzfile, "%s/%i/files/%s.tar.bz2", outdir, file->last_change, file->hash);
-		if (stat(bzfile, &sbuf) == 0) {
-			bz_size = sbuf.st_size;
-		}
-		string_or_die(&xzfile, "%s/%i/files/%s.tar.xz", outdir, file->last_change, file->hash);
-		if (stat(xzfile, &sbuf) == 0) {
-			xz_size = sbuf.st_size;
+		/* step 3: pick the smallest of the compression formats, on a tie
+		 * prefer them in gzip, xz, bzip2 order */
+		for (i = 0; i < count; i++) {
+			if (best < 0 || size[i] < size[best]) {
+				best = i;
+			}
 		}
-		string_or_die(&tarname, "%s/%i/files/%s.tar", outdir, file->last_change, file->hash);
-		if (gz_size <= xz_size && gz_size <= bz_size) {
-			ret = rename(gzfile, tarname);
-		} else if (xz_size <= bz_size) {
-			ret = rename(xzfile, tarname);
-		} else {
-			ret = rename(bzfile, tarname);
+		account_compression_choice(choice.class, count, choice.types[best], sbuf.st_size);
+		if (count > 1 && choice.predicted != COMPRESSION_TYPES) {
+			account_compression_prediction(choice.class, choice.types[best] == choice.predicted);
+			if (choice.types[best] != choice.predicted) {
+				LOG(file, "Compression misprediction", "%s (%s): predicted %s, got %s",
+				    file->hash, file_class_name(choice.class),
+				    compression_suffix(choice.predicted), compression_suffix(choice.types[best]));
+			}
 		}
+		string_or_die(&tarname, "%s/%s.tar", dir, file->hash);
+		ret = rename(compfile[best], tarname);
 		if (ret != 0) {
 			LOG(file, "post-tar rename failed", "ret=%d", ret);
+		} else {
+			object_store_add(key, tarname);
+			journal_append(file->hash);
+		}
+		for (i = 0; i < count; i++) {
+			if (i != best) {
+				unlink(compfile[i]);
+			}
+			free(compfile[i]);
 		}
-		unlink(bzfile);
-		unlink(xzfile);
-		unlink(gzfile);
-		free(bzfile);
-		free(xzfile);
-		free(gzfile);
 		free(tarname);
-
-		/* step 3: remove the hardlink */
-		unlink(tempfile);
-		free(tempfile);
 	}
 
+out:
 	free(indir);
 	free(outdir);
-	free(empty);
+	free(dir);
 	free(origin);
+	free(key);
 }
 
 static void create_fullfile_task(gpointer data, __unused__ gpointer user_data)
 {
 	struct file *file = data;
 
+	acquire_slot();
 	create_fullfile(file);
+	release_slots(1);
+}
+
+struct fullfile_work {
+	struct file *file;
+	uint64_t size;
+};
+
+static int fullfile_work_sort_size(const void *a, const void *b)
+{
+	const struct fullfile_work *A = a;
+	const struct fullfile_work *B = b;
+
+	if (A->size > B->size) {
+		return -1;
+	}
+	if (A->size < B->size) {
+		return 1;
+	}
+
+	return strcmp(A->file->filename, B->file->filename);
+}
+
+/* Order the fullfile work largest first, so the big files do not start at
+ * the end and leave the other threads idle while they finish. The size is
+ * taken from the hashing pass when known; manifests read back from disk do
+ * not carry it, so then the input file is looked at. */
+static GList *sort_fullfile_list_by_size(GList *files)
+{
+	struct fullfile_work *work;
+	struct file *file;
+	struct stat sbuf;
+	GList *item;
+	GList *sorted = NULL;
+	char *indir;
+	char *origin;
+	guint count = g_list_length(files);
+	guint i = 0;
+
+	work = calloc(count, sizeof(struct fullfile_work));
+	if (count && !work) {
+		assert(0);
+	}
+
+	indir = config_image_base();
+	for (item = files; item; item = g_list_next(item)) {
+		file = item->data;
+		work[i].file = file;
+		work[i].size = file->stat.st_size;
+		if (work[i].size == 0 && file->is_file) {
+			string_or_die(&origin, "%s/%i/full/%s", indir, file->last_change, file->filename);
+			if (lstat(origin, &sbuf) == 0) {
+				work[i].size = sbuf.st_size;
+			}
+			free(origin);
+		}
+		i++;
+	}
+	free(indir);
+
+	qsort(work, count, sizeof(struct fullfile_work), fullfile_work_sort_size);
+	while (i > 0) {
+		sorted = g_list_prepend(sorted, work[--i].file);
+	}
+	free(work);
+	g_list_free(files);
+
+	return sorted;
 }
 
 /* remove duplicate hashes from the fullfile creation list */
@@ -270,10 +634,8 @@ static GList *get_deduplicated_fullfile_list(struct manifest *manifest)
 		}
 	}
 
-	// don't want sort by hash else hash[0] locks will be very conflicted
-	outfiles = g_list_sort(outfiles, file_sort_filename);
-
-	return outfiles;
+	/* hashes are unique now, so no two tasks write the same output */
+	return sort_fullfile_list_by_size(outfiles);
 }
 
 static void submit_fullfile_tasks(GList *files)
@@ -283,6 +645,7 @@ static void submit_fullfile_tasks(GList *files)
 	struct file *file;
 	int ret;
 	int count = 0;
+	int skipped = 0;
 	GError *err = NULL;
 	int numthreads = num_threads(3.0);
 
@@ -290,6 +653,7 @@ static void submit_fullfile_tasks(GList *files)
 	threadpool = g_thread_pool_new(create_fullfile_task, NULL,
 				       numthreads,
 				       TRUE, NULL);
+	free_slots = numthreads;
 
 	printf("Starting downloadable fullfiles data creation\n");
 
@@ -303,6 +667,12 @@ static void submit_fullfile_tasks(GList *files)
 			continue;
 		}
 
+		/* completed by an earlier run */
+		if (g_hash_table_contains(journal, file->hash)) {
+			skipped++;
+			continue;
+		}
+
 		ret = g_thread_pool_push(threadpool, file, &err);
 		if (ret == FALSE) {
 			printf("GThread create_fullfile_task push error\n");
@@ -311,7 +681,7 @@ static void submit_fullfile_tasks(GList *files)
 		}
 		count++;
 	}
-	printf("queued %i full file creations\n", count);
+	printf("queued %i full file creations (%i already done)\n", count, skipped);
 
 	printf("Waiting for downloadable fullfiles data creation to finish\n");
 	g_thread_pool_free(threadpool, FALSE, TRUE);
@@ -320,43 +690,32 @@ static void submit_fullfile_tasks(GList *files)
 void create_fullfiles(struct manifest *manifest)
 {
 	GList *deduped_file_list;
-	char *path;
-	char *conf, *empty;
+	char *conf;
 
-	empty = config_empty_dir();
+	conf = config_output_dir();
 
-	char *const rmcmd[] = { "rm", "-rf", empty, NULL };
-	if (system_argv(rmcmd) != 0) {
-		assert(0);
+	if (layout_create_dir(conf, manifest->version, manifest->format, "files") != 0) {
+		free(conf);
+		return;
 	}
-	g_mkdir_with_parents(empty, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-	free(empty);
 
-	conf = config_output_dir();
+	fullfile_format = manifest->format;
 
-	string_or_die(&path, "%s/%i", conf, manifest->version);
-	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-		if (errno != EEXIST) {
-			LOG(NULL, "Failed to create directory ", "%s", path);
-			return;
-		}
-	}
-	free(path);
-	string_or_die(&path, "%s/%i/files/", conf, manifest->version);
-	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-		if (errno != EEXIST) {
-			LOG(NULL, "Failed to create directory ", "%s", path);
-			return;
-		}
-	}
-	free(path);
-	free(conf);
+	/* Pick up where an interrupted run stopped */
+	remove_partial_outputs(conf, manifest->version);
+	use_journal = journal_open(conf, manifest->version);
 
 	/* De-duplicate the list of fullfiles needing created to avoid races */
 	deduped_file_list = get_deduplicated_fullfile_list(manifest);
 
+	prepare_dictionary(deduped_file_list, conf, manifest->version);
+	free(conf);
+
 	/* Submit tasks to create full files */
 	submit_fullfile_tasks(deduped_file_list);
+	print_compression_statistics(fullfile_format);
+	compression_free_dictionary();
 
+	journal_close();
 	g_list_free(deduped_file_list);
 }
@@ -0,0 +1,243 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+static bool dry_run = false;
+static int collected;
+static int kept;
+static unsigned long long freed_bytes;
+
+static const struct option prog_opts[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "log-stdout", no_argument, 0, 'l' },
+	{ "dry-run", no_argument, 0, 'n' },
+	{ "statedir", required_argument, 0, 'S' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char *name)
+{
+	printf("usage:\n");
+	printf("   %s\n\n", name);
+	printf("Removes objects from the fullfile and delta object store that are no\n");
+	printf("longer hardlinked from any version's files/ or delta/ directory.\n\n");
+	printf("Help options:\n");
+	printf("   -h, --help              Show help options\n");
+	printf("   -l, --log-stdout        Write log messages also to stdout\n");
+	printf("   -n, --dry-run           Only report what would be removed\n");
+	printf("   -S, --statedir          Optional directory to use for state [ default:=%s ]\n", SWUPD_SERVER_STATE_DIR);
+	printf("\n");
+}
+
+static bool parse_options(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hlnS:", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case '?':
+		case 'h':
+			usage(argv[0]);
+			return false;
+		case 'l':
+			init_log_stdout();
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'S':
+			if (!optarg || !set_state_dir(optarg)) {
+				printf("Invalid --statedir argument '%s'\n\n", optarg);
+				return false;
+			}
+			break;
+		}
+	}
+
+	if (!init_state_globals()) {
+		return false;
+	}
+
+	return true;
+}
+
+static void banner(void)
+{
+	printf(PACKAGE_NAME " update creator -- object store gc -- version " PACKAGE_VERSION "\n");
+	printf("   Copyright (C) 2012-2016 Intel Corporation\n");
+	printf("\n");
+}
+
+/* an object's link count is its reference count: one link means only the
+ * store itself still refers to it */
+static void collect_shard(const char *shard)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	char *path;
+
+	dir = opendir(shard);
+	if (!dir) {
+		LOG(NULL, "Cannot open object shard", "%s: %s", shard, strerror(errno));
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		string_or_die(&path, "%s/%s", shard, entry->d_name);
+		if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		if (st.st_nlink > 1) {
+			kept++;
+			free(path);
+			continue;
+		}
+
+		LOG(NULL, dry_run ? "Unreferenced object" : "Removing object", "%s", path);
+		if (dry_run || unlink(path) == 0) {
+			collected++;
+			freed_bytes += st.st_size;
+		} else {
+			LOG(NULL, "Failed to remove object", "%s: %s", path, strerror(errno));
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	if (!dry_run) {
+		/* only succeeds once the shard is empty */
+		(void)rmdir(shard);
+	}
+}
+
+/* collect every shard of a store; returns -1 if it cannot be opened */
+static int collect_store(const char *storedir)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char *shard;
+
+	dir = opendir(storedir);
+	if (!dir) {
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || strlen(entry->d_name) != 2) {
+			continue;
+		}
+
+		string_or_die(&shard, "%s/%s", storedir, entry->d_name);
+		collect_shard(shard);
+		free(shard);
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *objdir;
+	char *deltadir;
+	char *file_path = NULL;
+
+	if (!setlocale(LC_ALL, "")) {
+		fprintf(stderr, "%s: setlocale() failed\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!parse_options(argc, argv)) {
+		free_state_globals();
+		return EXIT_FAILURE;
+	}
+
+	if (argc - optind != 0) {
+		usage(argv[0]);
+		free_state_globals();
+		exit(EXIT_FAILURE);
+	}
+
+	banner();
+	check_root();
+
+	string_or_die(&file_path, "%s/server.ini", state_dir);
+	if (!read_configuration_file(file_path)) {
+		free(file_path);
+		free_state_globals();
+		return EXIT_FAILURE;
+	}
+	free(file_path);
+
+	objdir = config_object_dir();
+	if (!objdir) {
+		printf("No objectdir configured in server.ini, nothing to collect\n");
+		release_configuration_data();
+		free_state_globals();
+		return EXIT_SUCCESS;
+	}
+
+	init_log("swupd-gc-objects", "", 0, 0);
+
+	if (collect_store(objdir) != 0) {
+		printf("Cannot open object store %s: %s\n", objdir, strerror(errno));
+		free(objdir);
+		release_configuration_data();
+		free_state_globals();
+		return EXIT_FAILURE;
+	}
+
+	/* stored deltas, absent until the first delta was made */
+	string_or_die(&deltadir, "%s/delta", objdir);
+	if (collect_store(deltadir) != 0 && errno != ENOENT) {
+		printf("Cannot open delta store %s: %s\n", deltadir, strerror(errno));
+	}
+	free(deltadir);
+
+	printf("%s %i unreferenced objects (%llu bytes), %i still referenced\n",
+	       dry_run ? "Found" : "Removed", collected, freed_bytes, kept);
+	LOG(NULL, "Object store gc", "%i collected, %llu bytes, %i kept", collected, freed_bytes, kept);
+
+	free(objdir);
+	release_configuration_data();
+	free_state_globals();
+
+	return EXIT_SUCCESS;
+}
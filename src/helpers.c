@@ -25,9 +25,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -35,6 +37,7 @@
 #include <unistd.h>
 
 #include "swupd.h"
+#include "xattrs.h"
 
 FILE *fopen_exclusive(const char *filename) /* no mode, opens for write only */
 {
@@ -51,6 +54,128 @@ FILE *fopen_exclusive(const char *filename) /* no mode, opens for write only */
 	return fdopen(fd, "w");
 }
 
+static int copy_data(int fdin, int fdout, off_t size)
+{
+	char buf[128 * 1024];
+	ssize_t len, ret;
+	char *p;
+
+	/* share the blocks when the filesystem supports reflinks */
+	if (ioctl(fdout, FICLONE, fdin) == 0) {
+		return 0;
+	}
+
+	/* let the kernel copy, server side or in-kernel for most filesystems */
+	while (size > 0) {
+		len = copy_file_range(fdin, NULL, fdout, NULL, size, 0);
+		if (len <= 0) {
+			break;
+		}
+		size -= len;
+	}
+	if (size == 0) {
+		return 0;
+	}
+
+	/* plain copy of whatever is left */
+	for (;;) {
+		len = read(fdin, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			return len;
+		}
+		for (p = buf; len > 0; p += ret, len -= ret) {
+			ret = write(fdout, p, len);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+			} else if (ret < 0) {
+				return -1;
+			}
+		}
+	}
+}
+
+/* Copy a regular file with its mode, ownership, timestamps and extended
+ * attributes. Fails with EEXIST like link() when "to" exists. The copy is
+ * made under a dot-prefixed temporary name next to "to" and linked into
+ * place when complete, so "to" never exists with partial content. */
+int copy_file(const char *from, const char *to)
+{
+	struct stat st;
+	struct timespec times[2];
+	char *dir, *name, *tmp;
+	int fdin, fdout;
+	int ret = -1;
+	int saved_errno;
+
+	fdin = open(from, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fdin < 0) {
+		return -1;
+	}
+	if (fstat(fdin, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fdin);
+		errno = EINVAL;
+		return -1;
+	}
+
+	dir = g_path_get_dirname(to);
+	name = g_path_get_basename(to);
+	string_or_die(&tmp, "%s/.%s.XXXXXX", dir, name);
+	free(dir);
+	free(name);
+	fdout = mkostemp(tmp, O_CLOEXEC);
+	if (fdout < 0) {
+		saved_errno = errno;
+		close(fdin);
+		free(tmp);
+		errno = saved_errno;
+		return -1;
+	}
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (copy_data(fdin, fdout, st.st_size) == 0 &&
+	    fchown(fdout, st.st_uid, st.st_gid) == 0 &&
+	    fchmod(fdout, st.st_mode & 07777) == 0 &&
+	    futimens(fdout, times) == 0) {
+		ret = 0;
+	}
+	saved_errno = errno;
+	if (close(fdout) != 0 && ret == 0) {
+		saved_errno = errno;
+		ret = -1;
+	}
+	close(fdin);
+
+	if (ret == 0) {
+		xattrs_copy(from, tmp);
+		if (link(tmp, to) != 0) {
+			saved_errno = errno;
+			ret = -1;
+		}
+	}
+	unlink(tmp);
+	free(tmp);
+	errno = saved_errno;
+	return ret;
+}
+
+/* Hardlink "from" to "to", copying instead when they are on different
+ * filesystems or the link count is exhausted. */
+int link_or_copy(const char *from, const char *to)
+{
+	if (link(from, to) == 0) {
+		return 0;
+	}
+	if (errno != EXDEV && errno != EMLINK) {
+		return -1;
+	}
+
+	return copy_file(from, to);
+}
+
 void dump_file_info(struct file *file)
 {
 	printf("%s:\n", file->filename);
@@ -0,0 +1,202 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Output directory layout.
+ *
+ * Traditionally <outputdir>/<version>/files/ and .../delta/ are flat and
+ * hold tens of thousands of entries per version. Versions whose format is
+ * at least the [Server] shardformat setting use a sharded layout instead,
+ * with one subdirectory per first two hash characters:
+ *   files/<hash>.tar                   -> files/ab/<hash>.tar
+ *   delta/<from>-<to>-<fromhash>-<hash> -> delta/ab/<from>-<to>-<fromhash>-<hash>
+ * where "ab" starts <hash>, the hash of the new content. A version is
+ * sharded when <outputdir>/<version>/.sharded exists; the layout is decided
+ * once, when the first of files/ and delta/ is created, so a version never
+ * mixes both layouts. Clients that still request the flat names can be
+ * served by a web server rewrite of a sharded version, e.g. for Apache:
+ *   RewriteRule ^(/[0-9]+/files)/([0-9a-f]{2})([0-9a-f]+\.tar)$ $1/$2/$2$3
+ *   RewriteRule ^(/[0-9]+/delta)/([0-9]+-[0-9]+-[0-9a-f]+-)([0-9a-f]{2})([0-9a-f]+)$ $1/$3/$2$3$4
+ * each guarded by the marker so flat versions are left alone:
+ *   RewriteCond %{DOCUMENT_ROOT}$1/../.sharded -f
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+#define SHARD_MARKER ".sharded"
+
+/* version -> 1 for flat, 2 for sharded; outputs of a version are looked
+ * up from every worker thread, so the marker is only checked once */
+static GHashTable *layouts;
+static GMutex layout_lock;
+
+static void remember_layout(int version, bool sharded)
+{
+	if (!layouts) {
+		layouts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	g_hash_table_replace(layouts, GINT_TO_POINTER(version), GINT_TO_POINTER(sharded ? 2 : 1));
+}
+
+bool version_is_sharded(const char *outdir, int version)
+{
+	char *marker;
+	gpointer known = NULL;
+	bool sharded;
+
+	g_mutex_lock(&layout_lock);
+	if (layouts) {
+		known = g_hash_table_lookup(layouts, GINT_TO_POINTER(version));
+	}
+	if (known) {
+		g_mutex_unlock(&layout_lock);
+		return GPOINTER_TO_INT(known) == 2;
+	}
+
+	string_or_die(&marker, "%s/%i/%s", outdir, version, SHARD_MARKER);
+	sharded = access(marker, F_OK) == 0;
+	free(marker);
+	remember_layout(version, sharded);
+	g_mutex_unlock(&layout_lock);
+
+	return sharded;
+}
+
+/* Decide the layout of a version that has neither files/ nor delta/ yet */
+static bool choose_layout(const char *outdir, int version, unsigned long long format)
+{
+	unsigned long long shard_format;
+	char *path;
+	bool fresh;
+	int fd;
+
+	if (version_is_sharded(outdir, version)) {
+		return true;
+	}
+
+	shard_format = config_shard_format();
+	if (shard_format == 0 || format < shard_format) {
+		return false;
+	}
+
+	string_or_die(&path, "%s/%i/files", outdir, version);
+	fresh = access(path, F_OK) != 0;
+	free(path);
+	string_or_die(&path, "%s/%i/delta", outdir, version);
+	fresh = fresh && access(path, F_OK) != 0;
+	free(path);
+	if (!fresh) {
+		/* already populated with the flat layout */
+		return false;
+	}
+
+	string_or_die(&path, "%s/%i/%s", outdir, version, SHARD_MARKER);
+	fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		LOG(NULL, "Failed to create layout marker", "%s: %s", path, strerror(errno));
+		free(path);
+		return false;
+	}
+	close(fd);
+	free(path);
+
+	g_mutex_lock(&layout_lock);
+	remember_layout(version, true);
+	g_mutex_unlock(&layout_lock);
+
+	return true;
+}
+
+/* Create <outdir>/<version>/<kind>/, and its shards when the version is
+ * sharded. Returns 0 on success, -1 on failure. */
+int layout_create_dir(const char *outdir, int version, unsigned long long format, const char *kind)
+{
+	char *path;
+	char *shard;
+	bool sharded;
+	int ret = 0;
+	int i;
+
+	string_or_die(&path, "%s/%i", outdir, version);
+	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+		LOG(NULL, "Failed to create directory ", "%s", path);
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	sharded = choose_layout(outdir, version, format);
+
+	string_or_die(&path, "%s/%i/%s", outdir, version, kind);
+	if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+		LOG(NULL, "Failed to create directory ", "%s", path);
+		free(path);
+		return -1;
+	}
+
+	/* all shards up front, so the workers never race to create them */
+	for (i = 0; sharded && i < 256; i++) {
+		string_or_die(&shard, "%s/%02x", path, i);
+		if (mkdir(shard, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+			LOG(NULL, "Failed to create directory ", "%s", shard);
+			ret = -1;
+		}
+		free(shard);
+	}
+	free(path);
+
+	return ret;
+}
+
+static char *output_dir(const char *outdir, int version, const char *kind, const char *hash)
+{
+	char *path;
+
+	if (version_is_sharded(outdir, version)) {
+		string_or_die(&path, "%s/%i/%s/%.2s", outdir, version, kind, hash);
+	} else {
+		string_or_die(&path, "%s/%i/%s", outdir, version, kind);
+	}
+
+	return path;
+}
+
+/* Directory holding the fullfile for "hash" in a version. Caller frees. */
+char *fullfile_dir(const char *outdir, int version, const char *hash)
+{
+	return output_dir(outdir, version, "files", hash);
+}
+
+/* Directory holding the deltas to the content "hash" in a version.
+ * Caller frees. */
+char *delta_dir(const char *outdir, int version, const char *hash)
+{
+	return output_dir(outdir, version, "delta", hash);
+}
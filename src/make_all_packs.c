@@ -0,0 +1,197 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+static GList *from_versions;
+
+static void banner(void)
+{
+	printf(PACKAGE_NAME " update pack creator -- multi pack -- version " PACKAGE_VERSION "\n");
+	printf("   Copyright (C) 2012-2016 Intel Corporation\n");
+	printf("\n");
+}
+
+static const struct option prog_opts[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "from", required_argument, 0, 'f' },
+	{ "log-stdout", no_argument, 0, 'l' },
+	{ "statedir", required_argument, 0, 'S' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char *name)
+{
+	printf("usage:\n");
+	printf("   %s [--from <start version>]... <latest version> <bundle>...\n\n", name);
+	printf("Makes the packs of every bundle from every start version to the latest\n");
+	printf("version, sharing the delta work between them.\n\n");
+	printf("Help options:\n");
+	printf("   -h, --help              Show help options\n");
+	printf("   -f, --from              Start version, may be repeated [ default:=0 ]\n");
+	printf("   -l, --log-stdout        Write log messages also to stdout\n");
+	printf("   -S, --statedir          Optional directory to use for state [ default:=%s ]\n", SWUPD_SERVER_STATE_DIR);
+	printf("\n");
+}
+
+static bool parse_options(int argc, char **argv)
+{
+	int opt;
+	char *end;
+	long version;
+
+	while ((opt = getopt_long(argc, argv, "hf:lS:", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case '?':
+		case 'h':
+			usage(argv[0]);
+			return false;
+		case 'f':
+			errno = 0;
+			version = strtol(optarg, &end, 10);
+			if (errno || *end != '\0' || end == optarg || version < 0 || version > INT_MAX) {
+				printf("Invalid --from argument '%s'\n\n", optarg);
+				return false;
+			}
+			if (!g_list_find(from_versions, GINT_TO_POINTER(version))) {
+				from_versions = g_list_append(from_versions, GINT_TO_POINTER(version));
+			}
+			break;
+		case 'l':
+			init_log_stdout();
+			break;
+		case 'S':
+			if (!optarg || !set_state_dir(optarg)) {
+				printf("Invalid --statedir argument ''%s'\n\n", optarg);
+				return false;
+			}
+			break;
+		}
+	}
+
+	/* FIXME: *_state_globals() are ugly hacks */
+	if (!init_state_globals()) {
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	long end_version;
+	int start_version;
+	GList *packs = NULL;
+	GList *item;
+	struct packdata *pack;
+	int exit_status = EXIT_FAILURE;
+	char *file_path = NULL;
+	bool duplicate;
+	int i, j;
+
+	if (!setlocale(LC_ALL, "")) {
+		fprintf(stderr, "%s: setlocale() failed\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!parse_options(argc, argv)) {
+		free_state_globals();
+		return EXIT_FAILURE;
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	banner();
+	check_root();
+
+	string_or_die(&file_path, "%s/server.ini", state_dir);
+	read_configuration_file(file_path);
+	free(file_path);
+
+	end_version = strtoull(argv[optind++], NULL, 10);
+	if (!from_versions) {
+		from_versions = g_list_append(from_versions, GINT_TO_POINTER(0));
+	}
+
+	for (item = g_list_first(from_versions); item; item = g_list_next(item)) {
+		start_version = GPOINTER_TO_INT(item->data);
+		if ((end_version == 0) || (start_version >= end_version)) {
+			printf("Invalid version combination: %i - %li \n", start_version, end_version);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	init_log("swupd-make-packs", "", 0, end_version);
+
+	for (i = optind; i < argc; i++) {
+		/* the same pack twice would share its staging directory */
+		duplicate = false;
+		for (j = optind; j < i; j++) {
+			if (strcmp(argv[j], argv[i]) == 0) {
+				duplicate = true;
+			}
+		}
+		if (duplicate) {
+			continue;
+		}
+		for (item = g_list_first(from_versions); item; item = g_list_next(item)) {
+			pack = calloc(1, sizeof(struct packdata));
+			if (pack == NULL) {
+				assert(0);
+			}
+
+			pack->module = argv[i];
+			pack->from = GPOINTER_TO_INT(item->data);
+			pack->to = end_version;
+			packs = g_list_append(packs, pack);
+
+			printf("Making pack-%s %i to %li\n", pack->module, pack->from, end_version);
+		}
+	}
+
+	if (make_packs(packs) == 0) {
+		exit_status = EXIT_SUCCESS;
+	}
+
+	printf("Pack creation %s (%i packs to %li)\n",
+	       exit_status == EXIT_SUCCESS ? "complete" : "failed",
+	       g_list_length(packs), end_version);
+
+	g_list_free_full(packs, free);
+	g_list_free(from_versions);
+	free_state_globals();
+	return exit_status;
+}
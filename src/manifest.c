@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive.h"
 #include "swupd.h"
 #include "xattrs.h"
 
@@ -349,6 +350,7 @@ void free_manifest(struct manifest *manifest)
 	while (manifest->files) {
 		file = manifest->files->data;
 		free(file->filename);
+		g_list_free(file->delta_sources);
 		free(file);
 		manifest->files = g_list_delete_link(manifest->files, manifest->files);
 	}
@@ -709,6 +711,72 @@ static void compute_content_size(struct manifest *manifest)
 	}
 }
 
+/* Hashes of the plain manifests written by this process, keyed by
+ * "<version>/<component>". The MoM takes its submanifest hashes from here
+ * rather than re-reading manifests that were just written. */
+static GHashTable *written_manifests = NULL;
+
+static char *manifest_hash_key(int version, const char *component)
+{
+	char *key;
+
+	string_or_die(&key, "%i/%s", version, component);
+	return key;
+}
+
+/* remember the hash and metadata of a manifest whose content is "data" */
+static void record_manifest_hash(struct manifest *manifest, char *filename, const char *data, size_t len)
+{
+	struct file *file;
+
+	file = calloc(1, sizeof(struct file));
+	if (file == NULL) {
+		assert(0);
+	}
+
+	populate_file_struct(file, filename);
+	if (file->is_deleted) {
+		free(file);
+		return;
+	}
+	compute_hash_for_data(file, filename, data, len);
+
+	if (!written_manifests) {
+		written_manifests = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	}
+	g_hash_table_replace(written_manifests, manifest_hash_key(manifest->version, manifest->component), file);
+}
+
+/* fill in hash and stat of a submanifest entry, preferring the recorded
+ * values and falling back to hashing the plain manifest on disk */
+static void submanifest_hash(struct file *file, char *conf)
+{
+	struct file *recorded = NULL;
+	char *filename = NULL;
+	char *key;
+
+	if (written_manifests) {
+		key = manifest_hash_key(file->last_change, file->filename);
+		recorded = g_hash_table_lookup(written_manifests, key);
+		free(key);
+	}
+
+	if (recorded) {
+		hash_assign(recorded->hash, file->hash);
+		file->stat = recorded->stat;
+		file->is_file = 1;
+		return;
+	}
+
+	string_or_die(&filename, "%s/%i/Manifest.%s", conf, file->last_change, file->filename);
+	populate_file_struct(file, filename);
+	if (!file->is_deleted && compute_hash(file, filename) != 0) {
+		printf("Hash computation failed\n");
+		assert(0);
+	}
+	free(filename);
+}
+
 /* Returns 0 == success, -1 == failure */
 static int write_manifest_plain(struct manifest *manifest)
 {
@@ -721,9 +789,8 @@ static int write_manifest_plain(struct manifest *manifest)
 	char *conf = config_output_dir();
 	char *filename = NULL;
 	char *status = NULL;
-	char *submanifest_filename = NULL;
-	char *manifest_tempdir = NULL;
-	char *tempmanifest = NULL;
+	char *content = NULL;
+	size_t content_len = 0;
 	int ret = -1;
 
 	if (conf == NULL) {
@@ -741,10 +808,11 @@ static int write_manifest_plain(struct manifest *manifest)
 		assert(0);
 	}
 
-	out = fopen(filename, "w");
+	/* build the manifest in memory so it can be hashed without reading it
+	 * back from disk */
+	out = open_memstream(&content, &content_len);
 	if (out == NULL) {
-		printf("Failed to open %s for write\n", filename);
-		goto exit;
+		assert(0);
 	}
 
 	fprintf(out, "MANIFEST\t%llu\n", format);
@@ -783,64 +851,39 @@ static int write_manifest_plain(struct manifest *manifest)
 	}
 
 	list = g_list_first(manifest->manifests);
-	string_or_die(&manifest_tempdir, "%s/XXXXXX", state_dir);
-	if (!mkdtemp(manifest_tempdir)) {
-		LOG(NULL, "Failed to create temporary directory %s for untarring Manifests", manifest_tempdir);
-		assert(0);
-	}
-
 	while (list) {
 		file = list->data;
 		list = g_list_next(list);
 
-		string_or_die(&submanifest_filename, "%s/%i/Manifest.%s", conf, file->last_change, file->filename);
-		populate_file_struct(file, submanifest_filename);
-
-		if (file->is_deleted) {
-			goto write_entry;
-		}
-
-		char *param1, *param2;
-
-		/* Untar the Manifest.BUNDLE.tar and calculate the hash on that,
-		 * otherwise we may get incorrect hashes due to owner permissions on
-		 * the files. */
-		string_or_die(&param1, "%s", manifest_tempdir);
-		string_or_die(&param2, "%s.tar", submanifest_filename);
-		char *const tarcmd[] = { TAR_COMMAND, "-C", param1, TAR_PERM_ATTR_ARGS_STRLIST, "-xf", param2, NULL };
-		ret = system_argv(tarcmd);
-		free(param1);
-		free(param2);
-
-		if (ret != 0) {
-			assert(0);
-		}
-
-		string_or_die(&tempmanifest, "%s/Manifest.%s", manifest_tempdir, file->filename);
-		populate_file_struct(file, tempmanifest);
-		ret = compute_hash(file, tempmanifest);
-		if (ret != 0) {
-			printf("Hash computation failed\n");
-			assert(0);
-		}
-		unlink(tempmanifest);
-		free(tempmanifest);
-	write_entry:
+		submanifest_hash(file, conf);
 		fprintf(out, "%s\t%s\t%i\t%s\n", file_type_to_string(file), file->hash, file->last_change, file->filename);
-		free(submanifest_filename);
 	}
 
+	fclose(out);
+	out = fopen(filename, "w");
+	if (out == NULL) {
+		printf("Failed to open %s for write\n", filename);
+		goto exit;
+	}
+	if (fwrite(content, 1, content_len, out) != content_len) {
+		printf("Failed to write %s\n", filename);
+		goto exit;
+	}
+	if (fclose(out) != 0) {
+		out = NULL;
+		printf("Failed to write %s\n", filename);
+		goto exit;
+	}
+	out = NULL;
+
+	record_manifest_hash(manifest, filename, content, content_len);
+
 	ret = 0;
 exit:
-	if (manifest_tempdir) {
-		if (rmdir(manifest_tempdir) != 0) {
-			LOG(NULL, "rmdir failed for %s: %s", manifest_tempdir, strerror(errno));
-		}
-		free(manifest_tempdir);
-	}
 	if (out) {
 		fclose(out);
 	}
+	free(content);
 	free(conf);
 	free(base);
 	free(filename);
@@ -863,9 +906,18 @@ static int write_manifest_tar(struct manifest *manifest)
 	string_or_die(&manifestcomp, "Manifest.%s", manifest->component);
 
 	/* now, tar the thing up for efficient full file download */
-	char *const tarcmd[] = { TAR_COMMAND, directory, TAR_PERM_ATTR_ARGS_STRLIST, "-Jcf",
-				 manifesttar, manifestcomp, NULL };
-	ret = system_argv(tarcmd);
+#ifdef SWUPD_WITH_ZSTD
+	if (compression_enabled(COMPRESSION_ZSTD, manifest->format)) {
+		char *const tarcmd[] = { TAR_COMMAND, directory, TAR_PERM_ATTR_ARGS_STRLIST, "-I", ZSTD_COMMAND, "-cf",
+					 manifesttar, manifestcomp, NULL };
+		ret = system_argv(tarcmd);
+	} else
+#endif
+	{
+		char *const tarcmd[] = { TAR_COMMAND, directory, TAR_PERM_ATTR_ARGS_STRLIST, "-Jcf",
+					 manifesttar, manifestcomp, NULL };
+		ret = system_argv(tarcmd);
+	}
 	if (ret) {
 		fprintf(stderr, "Creation of Manifest.tar failed\n");
 	}
@@ -1125,13 +1177,38 @@ void create_manifest_delta(int oldversion, int newversion, char *module)
 	}
 
 	string_or_die(&outfile, "%s/%i/Manifest-%s-delta-from-%i", conf, newversion, module, oldversion);
-	string_or_die(&dotfile, "%s/%i/.Manifest-%s-delta-from-%i", conf, newversion, module, oldversion);
+
+	/* create_update and every pack maker want the same deltas; only the
+	 * owner of the claim makes it, the others wait for it to finish */
+	if (!claim_output(outfile)) {
+		goto exit;
+	}
+	dotfile = claim_tmpfile(outfile);
 
 	ret = xattrs_compare(original, newfile);
 	if (ret != 0) {
 		LOG(NULL, "xattrs have changed, don't create diff ", "%s", newfile);
-		sleep(1);
-	} else if (make_bsdiff_delta(original, newfile, dotfile, 0) == 0) {
+		release_claim(outfile);
+		goto exit;
+	}
+
+	/* record deltas where clients know them, bsdiff otherwise */
+	ret = 1;
+	if (config_manifest_delta_format() > 0) {
+		ret = make_manifest_delta(original, newfile, dotfile, config_manifest_delta_format());
+		if (ret < 0) {
+			LOG(NULL, "Record delta failed, using bsdiff", "%s", outfile);
+			unlink(dotfile);
+		}
+	}
+	if (ret != 0) {
+		ret = make_bsdiff_delta(original, newfile, dotfile, 0);
+	}
+	if (ret == 0 && !claim_held(outfile)) {
+		/* displaced by another owner, which makes the delta */
+		LOG(NULL, "Lost claim on manifest delta", "%s", outfile);
+		unlink(dotfile);
+	} else if (ret == 0) {
 		if (rename(dotfile, outfile) != 0) {
 			if (errno == ENOENT) {
 				LOG(NULL, "dotfile:", " %s does not exist", dotfile);
@@ -1139,8 +1216,10 @@ void create_manifest_delta(int oldversion, int newversion, char *module)
 			LOG(NULL, "Failed to rename", "");
 		}
 	} else {
-		sleep(1); /* we raced. whatever. sleep for a bit to get the other guy to make progress */
+		LOG(NULL, "Failed to create manifest delta", "%s", outfile);
+		unlink(dotfile);
 	}
+	release_claim(outfile);
 
 exit:
 	free(conf);
@@ -1150,19 +1229,101 @@ exit:
 	free(dotfile);
 }
 
-void create_manifest_deltas(struct manifest *manifest, GList *last_versions_list)
+struct manifest_delta_task {
+	int from;
+	int to;
+	char *component;
+};
+
+static void create_manifest_delta_task(gpointer data, __unused__ gpointer user_data)
 {
-	GList *item;
+	struct manifest_delta_task *task = data;
+
+	create_manifest_delta(task->from, task->to, task->component);
+	free(task->component);
+	free(task);
+}
+
+/* Queue the delta from "component" as of version "from", once per pair */
+static void push_manifest_delta(GThreadPool *threadpool, GHashTable *seen,
+				int from, int to, const char *component)
+{
+	struct manifest_delta_task *task;
+	GError *err = NULL;
+	char *key;
+
+	if (from <= 0 || from >= to) {
+		return;
+	}
+
+	string_or_die(&key, "%s:%i", component, from);
+	if (g_hash_table_contains(seen, key)) {
+		free(key);
+		return;
+	}
+	g_hash_table_add(seen, key);
+
+	task = calloc(1, sizeof(struct manifest_delta_task));
+	if (task == NULL) {
+		assert(0);
+	}
+	task->from = from;
+	task->to = to;
+	task->component = strdup(component);
+	if (task->component == NULL) {
+		assert(0);
+	}
+
+	if (!g_thread_pool_push(threadpool, task, &err)) {
+		fprintf(stderr, "GThread manifest delta push error\n");
+		fprintf(stderr, "%s\n", err->message);
+		assert(0);
+	}
+}
+
+/* Create the deltas of the MoM and of every bundle manifest new in this
+ * version from the manifests that clients of the previous versions have.
+ * Many previous versions share the manifest of a bundle that changed
+ * rarely, so each (bundle, old manifest) pair is only diffed once; the
+ * pairs run in parallel. */
+void create_manifest_deltas(struct manifest *mom, GList *last_versions_list)
+{
+	GThreadPool *threadpool;
+	GHashTable *seen;
+	GList *item, *list;
+	struct manifest *old_mom;
+	struct file *file;
 	int prev_version;
 
-	LOG(NULL, "Creating manifest deltas", "%d %s", manifest->version, manifest->component);
-	/* Create manifest deltas from the previous manifests */
-	item = g_list_first(last_versions_list);
-	while (item) {
+	LOG(NULL, "Creating manifest deltas", "%d", mom->version);
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	threadpool = g_thread_pool_new(create_manifest_delta_task, NULL,
+				       num_threads(1.0), FALSE, NULL);
+
+	for (item = g_list_first(last_versions_list); item; item = g_list_next(item)) {
 		prev_version = GPOINTER_TO_INT(item->data);
-		item = g_list_next(item);
-		create_manifest_delta(prev_version, manifest->version, manifest->component);
+
+		old_mom = manifest_from_file(prev_version, "MoM");
+		if (!old_mom) {
+			continue;
+		}
+		push_manifest_delta(threadpool, seen, prev_version, mom->version, "MoM");
+
+		for (list = g_list_first(mom->manifests); list; list = g_list_next(list)) {
+			file = list->data;
+			/* unchanged bundles keep their old manifest */
+			if (file->last_change != mom->version) {
+				continue;
+			}
+			push_manifest_delta(threadpool, seen, manifest_subversion(old_mom, file->filename),
+					    mom->version, file->filename);
+		}
+		free_manifest(old_mom);
 	}
+
+	printf("Waiting for %i manifest deltas to be created\n", g_hash_table_size(seen));
+	g_thread_pool_free(threadpool, FALSE, TRUE);
+	g_hash_table_destroy(seen);
 	LOG(NULL, "Done creating manifest deltas", "");
 }
 
@@ -0,0 +1,409 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Record based manifest deltas.
+ *
+ * A manifest is a header, an empty line and one record per file, keyed by
+ * the file name in its last field. Between versions most records stay the
+ * same and keep their relative order, so instead of running bsdiff over the
+ * text the delta lists what changed:
+ *
+ *   MANIFEST-DELTA	1
+ *   <the header of the new manifest, including its empty line>
+ *   -	<file name>			a record that is gone
+ *   +	<index>	<record>		a new or changed record, at that
+ *   					(0 based) index of the new records
+ *
+ * All other records of the old manifest are copied in their order to the
+ * remaining indexes. Making the delta is a single pass over both
+ * manifests, and the delta only grows with the number of changes.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+#define MANIFEST_DELTA_MAGIC "MANIFEST-DELTA\t1\n"
+
+struct manifest_text {
+	char *content;		/* modified in place: lines are split */
+	char *header;		/* up to and including the empty line */
+	size_t header_len;
+	char **records;
+	size_t count;
+};
+
+static void free_manifest_text(struct manifest_text *text)
+{
+	free(text->content);
+	free(text->records);
+}
+
+/* the file name is the last of the four tab separated fields */
+static const char *record_name(const char *record)
+{
+	const char *name = record;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		name = strchr(name, '\t');
+		if (!name) {
+			return NULL;
+		}
+		name++;
+	}
+	return name;
+}
+
+/* Split "content" into the header and the records. Returns false if it
+ * does not look like a manifest. */
+static bool split_manifest(char *content, size_t len, struct manifest_text *text)
+{
+	char *end, *line, *next;
+	size_t allocated = 0;
+
+	memset(text, 0, sizeof(struct manifest_text));
+	text->content = content;
+	if (len == 0 || content[len - 1] != '\n') {
+		return false;
+	}
+
+	end = strstr(content, "\n\n");
+	if (!end) {
+		return false;
+	}
+	text->header = content;
+	text->header_len = end + 2 - content;
+
+	for (line = end + 2; line < content + len; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		if (!record_name(line)) {
+			return false;
+		}
+		if (text->count == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			text->records = realloc(text->records, allocated * sizeof(char *));
+			if (!text->records) {
+				assert(0);
+			}
+		}
+		text->records[text->count++] = line;
+	}
+
+	return true;
+}
+
+static bool read_manifest_text(const char *filename, struct manifest_text *text)
+{
+	char *content = NULL;
+	gsize len = 0;
+
+	memset(text, 0, sizeof(struct manifest_text));
+	if (!g_file_get_contents(filename, &content, &len, NULL)) {
+		LOG(NULL, "Failed to read manifest", "%s", filename);
+		return false;
+	}
+	if (!split_manifest(content, len, text)) {
+		LOG(NULL, "Not a manifest", "%s", filename);
+		return false;
+	}
+	return true;
+}
+
+/* Apply a record delta to the text of the old manifest. Returns the new
+ * manifest, or NULL if the delta is malformed or does not fit. */
+static char *apply_records(const struct manifest_text *old, char *delta, size_t delta_len, size_t *new_len)
+{
+	GHashTable *dropped;
+	char *content = NULL;
+	char *line, *next, *end;
+	char *header_end;
+	const char *name;
+	size_t content_len = 0;
+	size_t kept = 0;
+	unsigned long index = 0, wanted;
+	FILE *out;
+	bool ok = false;
+
+	if (delta_len < strlen(MANIFEST_DELTA_MAGIC) ||
+	    strncmp(delta, MANIFEST_DELTA_MAGIC, strlen(MANIFEST_DELTA_MAGIC)) != 0 ||
+	    delta[delta_len - 1] != '\n') {
+		return NULL;
+	}
+	delta += strlen(MANIFEST_DELTA_MAGIC);
+	header_end = strstr(delta, "\n\n");
+	if (!header_end) {
+		return NULL;
+	}
+	header_end += 2;
+
+	/* every record named by an operation is not copied from the old one */
+	dropped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (line = header_end; *line; line = strchr(line, '\n') + 1) {
+		if (line[0] == '-' && line[1] == '\t') {
+			name = line + 2;
+		} else if (line[0] == '+' && line[1] == '\t' && (name = strchr(line + 2, '\t'))) {
+			name = record_name(name + 1);
+		} else {
+			goto out;
+		}
+		if (!name) {
+			goto out;
+		}
+		g_hash_table_add(dropped, g_strndup(name, strchr(name, '\n') - name));
+	}
+
+	out = open_memstream(&content, &content_len);
+	if (out == NULL) {
+		assert(0);
+	}
+	fwrite(delta, 1, header_end - delta, out);
+
+	for (line = header_end; *line; line = next) {
+		next = strchr(line, '\n') + 1;
+		if (line[0] != '+') {
+			continue;
+		}
+		errno = 0;
+		wanted = strtoul(line + 2, &end, 10);
+		if (errno || *end != '\t' || wanted < index) {
+			fclose(out);
+			goto out;
+		}
+		/* old records fill the indexes up to the next new one */
+		while (index < wanted) {
+			while (kept < old->count && g_hash_table_contains(dropped, record_name(old->records[kept]))) {
+				kept++;
+			}
+			if (kept == old->count) {
+				fclose(out);
+				goto out;
+			}
+			fprintf(out, "%s\n", old->records[kept++]);
+			index++;
+		}
+		fwrite(end + 1, 1, next - end - 1, out);
+		index++;
+	}
+	for (; kept < old->count; kept++) {
+		if (!g_hash_table_contains(dropped, record_name(old->records[kept]))) {
+			fprintf(out, "%s\n", old->records[kept]);
+		}
+	}
+	fclose(out);
+	ok = true;
+
+out:
+	g_hash_table_destroy(dropped);
+	if (!ok) {
+		free(content);
+		return NULL;
+	}
+	*new_len = content_len;
+	return content;
+}
+
+/* Make the delta text from "old" to "new", or return NULL if the records
+ * cannot be expressed this way (a file name is listed twice). */
+static char *make_records(const struct manifest_text *old, const struct manifest_text *new, size_t *delta_len)
+{
+	GHashTable *old_records;
+	GHashTable *new_names;
+	const char *previous;
+	char *delta = NULL;
+	size_t i;
+	FILE *out;
+	bool ok = false;
+
+	old_records = g_hash_table_new(g_str_hash, g_str_equal);
+	new_names = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < old->count; i++) {
+		if (g_hash_table_contains(old_records, record_name(old->records[i]))) {
+			goto out;
+		}
+		g_hash_table_insert(old_records, (char *)record_name(old->records[i]), old->records[i]);
+	}
+	for (i = 0; i < new->count; i++) {
+		if (g_hash_table_contains(new_names, record_name(new->records[i]))) {
+			goto out;
+		}
+		g_hash_table_add(new_names, (char *)record_name(new->records[i]));
+	}
+
+	out = open_memstream(&delta, delta_len);
+	if (out == NULL) {
+		assert(0);
+	}
+	fputs(MANIFEST_DELTA_MAGIC, out);
+	fwrite(new->header, 1, new->header_len, out);
+	for (i = 0; i < old->count; i++) {
+		if (!g_hash_table_contains(new_names, record_name(old->records[i]))) {
+			fprintf(out, "-\t%s\n", record_name(old->records[i]));
+		}
+	}
+	for (i = 0; i < new->count; i++) {
+		previous = g_hash_table_lookup(old_records, record_name(new->records[i]));
+		if (!previous || strcmp(previous, new->records[i]) != 0) {
+			fprintf(out, "+\t%zu\t%s\n", i, new->records[i]);
+		}
+	}
+	fclose(out);
+	ok = true;
+
+out:
+	g_hash_table_destroy(old_records);
+	g_hash_table_destroy(new_names);
+	if (!ok) {
+		free(delta);
+		return NULL;
+	}
+	return delta;
+}
+
+static int write_content(const char *filename, const char *content, size_t len)
+{
+	FILE *out;
+	int ret = 0;
+
+	out = fopen(filename, "w");
+	if (!out) {
+		LOG(NULL, "Failed to create file", "%s: %s", filename, strerror(errno));
+		return -1;
+	}
+	if (fwrite(content, 1, len, out) != len) {
+		ret = -1;
+	}
+	if (fclose(out) != 0) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		LOG(NULL, "Failed to write file", "%s", filename);
+		unlink(filename);
+	}
+	return ret;
+}
+
+/* Returns 0 when the delta was written, 1 when the manifests are not
+ * suitable for a record delta (so bsdiff has to be used), and -1 on
+ * errors. Record deltas are only made for new manifests of at least
+ * "min_format". The delta is checked by applying it before it is written. */
+int make_manifest_delta(const char *original, const char *newfile, const char *delta,
+			unsigned long long min_format)
+{
+	struct manifest_text old, new = { 0 };
+	char *content = NULL, *check = NULL;
+	size_t content_len = 0, check_len = 0;
+	char *new_content = NULL;
+	gsize new_len = 0;
+	unsigned long long format;
+	int ret = -1;
+
+	if (!read_manifest_text(original, &old)) {
+		free_manifest_text(&old);
+		return -1;
+	}
+	/* the text is split in place, keep a copy to check the result */
+	if (!g_file_get_contents(newfile, &new_content, &new_len, NULL)) {
+		free_manifest_text(&old);
+		return -1;
+	}
+	if (sscanf(new_content, "MANIFEST\t%llu\n", &format) != 1 || format < min_format) {
+		ret = 1;
+		goto out;
+	}
+	if (!read_manifest_text(newfile, &new)) {
+		goto out;
+	}
+
+	content = make_records(&old, &new, &content_len);
+	if (!content) {
+		ret = 1;
+		goto out;
+	}
+	check = apply_records(&old, content, content_len, &check_len);
+	if (!check || check_len != new_len || memcmp(check, new_content, new_len) != 0) {
+		/* the records were reordered */
+		ret = 1;
+		goto out;
+	}
+	ret = write_content(delta, content, content_len);
+
+out:
+	free(content);
+	free(check);
+	free(new_content);
+	free_manifest_text(&old);
+	free_manifest_text(&new);
+	return ret;
+}
+
+bool is_manifest_delta(const char *delta)
+{
+	char magic[sizeof(MANIFEST_DELTA_MAGIC) - 1];
+	FILE *in;
+	bool ret;
+
+	in = fopen(delta, "r");
+	if (!in) {
+		return false;
+	}
+	ret = fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+	      memcmp(magic, MANIFEST_DELTA_MAGIC, sizeof(magic)) == 0;
+	fclose(in);
+	return ret;
+}
+
+/* Returns 0 when "newfile" was recreated from "original" and "delta" */
+int apply_manifest_delta(const char *original, const char *delta, const char *newfile)
+{
+	struct manifest_text old;
+	char *content = NULL, *result;
+	gsize content_len = 0;
+	size_t result_len = 0;
+	int ret = -1;
+
+	if (!read_manifest_text(original, &old)) {
+		free_manifest_text(&old);
+		return -1;
+	}
+	if (!g_file_get_contents(delta, &content, &content_len, NULL)) {
+		free_manifest_text(&old);
+		return -1;
+	}
+
+	result = apply_records(&old, content, content_len, &result_len);
+	if (result) {
+		ret = write_content(newfile, result, result_len);
+		free(result);
+	} else {
+		LOG(NULL, "Malformed manifest delta", "%s", delta);
+	}
+
+	free(content);
+	free_manifest_text(&old);
+	return ret;
+}
@@ -0,0 +1,236 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Content-addressed object store.
+ *
+ * Fullfile tars are kept once per content hash in
+ * <objectdir>/<first two hash chars>/<hash>.tar, and every
+ * fullfile of a version (<outputdir>/<version>/files/<hash>.tar, or its
+ * sharded equivalent) is a hardlink to that object.
+ * The link count of an object is therefore its reference count: an object
+ * with a single link is no longer used by any published version and can be
+ * collected by swupd_gc_objects. When the store and the output directory
+ * are on different filesystems objects are copied instead; such copies are
+ * not counted and only save the compression work until the next collection.
+ * Fullfiles that may be compressed with a version's zstd dictionary are
+ * only usable with that dictionary, so they are stored as
+ * <hash>.dict-<dictionary id>.tar and only shared between versions using
+ * the same dictionary.
+ *
+ * Deltas are stored the same way, keyed by the pair of contents they
+ * convert between, as <objectdir>/delta/<first two to-hash chars>/
+ * <from-hash>-<to-hash>, and hardlinked to every
+ * <outputdir>/<version>/delta/<from>-<to>-<from-hash>-<to-hash> that needs
+ * them. Content that flips between the same two states across versions
+ * then only goes through bsdiff once. Pairs for which no useful delta
+ * exists are remembered by an empty <from-hash>-<to-hash>.none marker,
+ * which is dropped by the next collection.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "swupd.h"
+
+/* Returns the store path for a fullfile with the given key (the hash, see
+ * above), or NULL when no object store is configured. Caller frees. */
+char *object_path(const char *hash)
+{
+	char *objdir;
+	char *path;
+
+	objdir = config_object_dir();
+	if (!objdir) {
+		return NULL;
+	}
+
+	string_or_die(&path, "%s/%.2s/%s.tar", objdir, hash, hash);
+	free(objdir);
+
+	return path;
+}
+
+/* Returns the store path for the delta between two contents made by
+ * "engine", or NULL when no object store is configured. bsdiff deltas keep
+ * the plain name, other engines get their name as suffix. Caller frees. */
+char *delta_object_path(const char *from_hash, const char *to_hash, const char *engine)
+{
+	char *objdir;
+	char *path;
+
+	objdir = config_object_dir();
+	if (!objdir) {
+		return NULL;
+	}
+
+	if (strcmp(engine, "bsdiff") == 0) {
+		string_or_die(&path, "%s/delta/%.2s/%s-%s", objdir, to_hash, from_hash, to_hash);
+	} else {
+		string_or_die(&path, "%s/delta/%.2s/%s-%s.%s", objdir, to_hash, from_hash, to_hash, engine);
+	}
+	free(objdir);
+
+	return path;
+}
+
+static bool store_fetch(const char *path, const char *target)
+{
+	if (link_or_copy(path, target) == 0 || errno == EEXIST) {
+		return true;
+	}
+	if (errno != ENOENT) {
+		LOG(NULL, "Failed to link object", "%s to %s (%s)", path, target, strerror(errno));
+	}
+	return false;
+}
+
+static void store_add(const char *path, const char *source)
+{
+	char *dir;
+
+	dir = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
+		LOG(NULL, "Failed to create directory", "%s", dir);
+		free(dir);
+		return;
+	}
+	free(dir);
+
+	if (link_or_copy(source, path) != 0 && errno != EEXIST) {
+		LOG(NULL, "Failed to store object", "%s to %s (%s)", source, path, strerror(errno));
+	}
+}
+
+/* Hardlink a previously stored object to "target".
+ * Returns true if target now holds the content for "hash". */
+bool object_store_fetch(const char *hash, const char *target)
+{
+	char *path;
+	bool ret;
+
+	path = object_path(hash);
+	if (!path) {
+		return false;
+	}
+
+	ret = store_fetch(path, target);
+	free(path);
+	return ret;
+}
+
+/* Add a freshly created fullfile to the store. Losing a race against
+ * another producer of the same content is harmless. */
+void object_store_add(const char *hash, const char *source)
+{
+	char *path;
+
+	path = object_path(hash);
+	if (!path) {
+		return;
+	}
+
+	store_add(path, source);
+	free(path);
+}
+
+/* Hardlink a previously computed delta to "target".
+ * Returns true if target now holds the delta from "from_hash" to "to_hash". */
+bool delta_store_fetch(const char *from_hash, const char *to_hash, const char *engine, const char *target)
+{
+	char *path;
+	bool ret;
+
+	path = delta_object_path(from_hash, to_hash, engine);
+	if (!path) {
+		return false;
+	}
+
+	ret = store_fetch(path, target);
+	free(path);
+	return ret;
+}
+
+/* Add a freshly created and verified delta to the store. */
+void delta_store_add(const char *from_hash, const char *to_hash, const char *engine, const char *source)
+{
+	char *path;
+
+	path = delta_object_path(from_hash, to_hash, engine);
+	if (!path) {
+		return;
+	}
+
+	store_add(path, source);
+	free(path);
+}
+
+/* Check whether a delta between the two contents was found not to be
+ * worth shipping before. */
+bool delta_store_is_useless(const char *from_hash, const char *to_hash, const char *engine)
+{
+	char *path;
+	char *marker;
+	bool ret;
+
+	path = delta_object_path(from_hash, to_hash, engine);
+	if (!path) {
+		return false;
+	}
+
+	string_or_die(&marker, "%s.none", path);
+	ret = access(marker, F_OK) == 0;
+	free(marker);
+	free(path);
+	return ret;
+}
+
+/* Remember that no useful delta exists between the two contents. */
+void delta_store_mark_useless(const char *from_hash, const char *to_hash, const char *engine)
+{
+	char *path;
+	char *marker;
+	char *dir;
+	int fd;
+
+	path = delta_object_path(from_hash, to_hash, engine);
+	if (!path) {
+		return;
+	}
+
+	dir = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0) {
+		string_or_die(&marker, "%s.none", path);
+		fd = open(marker, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(marker);
+	}
+	free(dir);
+	free(path);
+}
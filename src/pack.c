@@ -36,6 +36,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "delta.h"
 #include "swupd.h"
 
 static void empty_pack_stage(int full, int from_version, int to_version, char *module)
@@ -126,7 +128,9 @@ static void explode_pack_stage(int from_version, int to_version, char *module)
 	closedir(dir);
 }
 
-static void prepare_pack(struct packdata *pack)
+/* Returns 0 == success (which includes a bundle that did not exist in the
+ * from version, it gets no pack), -1 == failure */
+static int prepare_pack(struct packdata *pack)
 {
 	struct manifest *manifest;
 
@@ -135,17 +139,27 @@ static void prepare_pack(struct packdata *pack)
 	manifest = manifest_from_file(pack->from, pack->module);
 	if (!manifest || ((manifest->count == 0) && (manifest->version > 0))) {
 		free(manifest);
-		return;
+		return 0;
 	}
+	pack->from_manifest = manifest;
 
 	/* read in manifest from file */
 	pack->end_manifest = manifest_from_file(pack->to, pack->module);
+	if (!pack->end_manifest) {
+		LOG(NULL, "Failed to read end manifest", "%s: %i", pack->module, pack->to);
+		free_manifest(pack->from_manifest);
+		pack->from_manifest = NULL;
+		return -1;
+	}
+	delta_engine_set_format(pack->end_manifest->format);
 	/* wipe any old packs (failed) and re-create pack directory structure */
 	empty_pack_stage(0, pack->from, pack->to, pack->module);
 	/* match up old and new manifests */
 	match_manifests(manifest, pack->end_manifest);
 	/* link renames together */
 	link_renames(pack->end_manifest->files, pack->to);
+
+	return 0;
 }
 
 static void make_pack_full_files(struct packdata *pack)
@@ -168,13 +182,15 @@ static void make_pack_full_files(struct packdata *pack)
 		    !file->is_ghosted &&  /* no full-files for ghosts */
 		    !file->rename_peer) { /* no full-files for renames */
 			char *from, *to;
-			char *fullfrom, *fullto;
+			char *fullfrom, *fullto, *dir;
 
 			/* hardlink each file that is in <end> but not in <X> */
 			string_or_die(&fullfrom, "%s/%i/full/%s", image_dir, file->last_change, file->filename);
 			string_or_die(&fullto, "%s/%s/%i_to_%i/staged/%s", packstage_dir,
 				      pack->module, pack->from, pack->to, file->hash);
-			string_or_die(&from, "%s/%i/files/%s.tar", staging_dir, file->last_change, file->hash);
+			dir = fullfile_dir(staging_dir, file->last_change, file->hash);
+			string_or_die(&from, "%s/%s.tar", dir, file->hash);
+			free(dir);
 			string_or_die(&to, "%s/%s/%i_to_%i/staged/%s.tar", packstage_dir,
 				      pack->module, pack->from, pack->to, file->hash);
 
@@ -186,13 +202,13 @@ static void make_pack_full_files(struct packdata *pack)
 			 * versions if the hardlink fails.
 			 */
 			if (!file->is_dir) {
-				ret = link(fullfrom, fullto);
+				ret = link_or_copy(fullfrom, fullto);
 				if (ret && errno != EEXIST) {
 					LOG(NULL, "Failure to link for fullfile pack", "%s to %s (%s) %i", fullfrom, fullto, strerror(errno), errno);
 				}
 			}
 			if (ret) {
-				ret = link(from, to);
+				ret = link_or_copy(from, to);
 				if (ret && errno != EEXIST) {
 					LOG(NULL, "Failure to link for fullfile pack", "%s to %s (%s) %i", from, to, strerror(errno), errno);
 				}
@@ -213,40 +229,180 @@ static void make_pack_full_files(struct packdata *pack)
 	    pack->module, pack->from, pack->to);
 }
 
-static int find_file_in_list(GList *files, struct file *file)
+/* at most this many files of the from manifest are candidate delta
+ * sources besides the peer */
+#define DELTA_CANDIDATES 8
+
+static const char *file_basename(const char *filename)
+{
+	const char *name = strrchr(filename, '/');
+
+	return name ? name + 1 : filename;
+}
+
+/* the regular files of "manifest" by their base name */
+static GHashTable *index_basenames(struct manifest *manifest)
+{
+	GHashTable *index;
+	GList *item;
+	GList *files;
+	struct file *file;
+	const char *name;
+
+	index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_list_free);
+	for (item = g_list_first(manifest->files); item; item = g_list_next(item)) {
+		file = item->data;
+		if (!file->is_file || file->is_deleted || file->is_ghosted) {
+			continue;
+		}
+		name = file_basename(file->filename);
+		files = g_hash_table_lookup(index, name);
+		if (files) {
+			/* behind the head, which the table owns */
+			g_list_insert(files, file, 1);
+		} else {
+			g_hash_table_insert(index, (char *)name, g_list_prepend(NULL, file));
+		}
+	}
+
+	return index;
+}
+
+static bool is_delta_source(struct file *file, struct file *source)
 {
 	GList *item;
-	struct file *item_file;
 
-	item = g_list_first(files);
+	if (!source->is_file || source->is_deleted || source->is_ghosted ||
+	    hash_compare(source->hash, file->hash) || hash_compare(source->hash, file->peer->hash)) {
+		return false;
+	}
+	/* one delta per source content */
+	for (item = g_list_first(file->delta_sources); item; item = g_list_next(item)) {
+		if (hash_compare(source->hash, ((struct file *)item->data)->hash)) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	while (item) {
-		item_file = item->data;
-		item = g_list_next(item);
+/* Besides the peer, a file churning heavily may be closer to its rename
+ * peer or to another file of the same name elsewhere in the tree */
+static void collect_delta_sources(struct file *file, struct packdata *pack, GHashTable *basenames)
+{
+	GList *item;
+	struct file *source;
+	int count = 0;
+
+	source = file->rename_peer;
+	if (source && source != file->peer && source->last_change <= pack->from &&
+	    is_delta_source(file, source)) {
+		file->delta_sources = g_list_append(file->delta_sources, source);
+		count++;
+	}
 
-		if (hash_compare(item_file->hash, file->hash) &&
-		    (item_file->last_change == file->last_change) &&
-		    (item_file->peer->last_change == file->peer->last_change)) {
-			LOG(NULL, "Found a duplicate delta", "%d %d %s %s", file->peer->last_change, file->last_change, file->hash, file->filename);
-			return TRUE;
+	item = g_hash_table_lookup(basenames, file_basename(file->filename));
+	for (; item && count < DELTA_CANDIDATES; item = g_list_next(item)) {
+		source = item->data;
+		if (source != file->peer && is_delta_source(file, source)) {
+			file->delta_sources = g_list_append(file->delta_sources, source);
+			count++;
+		}
+	}
+}
+
+static bool delta_exists(struct file *file, struct file *source)
+{
+	char *dir, *path;
+	bool ret;
+
+	dir = delta_dir(staging_dir, file->last_change, file->hash);
+	string_or_die(&path, "%s/%i-%i-%s-%s", dir, source->last_change, file->last_change, source->hash, file->hash);
+	ret = access(path, F_OK) == 0;
+	free(dir);
+	free(path);
+
+	return ret;
+}
+
+/* The delta work for one file and peer, shared by every pack needing it.
+ * The packs' from manifests can each offer other candidate sources, so
+ * "sources" is their union; each pack still only ships a delta from its
+ * own file->delta_sources. */
+struct pack_delta {
+	struct file *file;
+	GList *sources;
+	bool queued;
+};
+
+static void free_pack_delta(gpointer data)
+{
+	struct pack_delta *delta = data;
+
+	g_list_free(delta->sources);
+	free(delta);
+}
+
+/* whether the delta from the peer or one from another candidate source
+ * has yet to be made */
+static bool deltas_missing(struct pack_delta *delta)
+{
+	GList *item;
+
+	if (!delta_exists(delta->file, delta->file->peer)) {
+		return true;
+	}
+	for (item = g_list_first(delta->sources); item; item = g_list_next(item)) {
+		if (!delta_exists(delta->file, item->data)) {
+			return true;
 		}
 	}
+	return false;
+}
 
-	return FALSE;
+/* add the candidate sources of "file" not yet in "delta"; a delta is named
+ * after the version and hash of its source */
+static void merge_delta_sources(struct pack_delta *delta, struct file *file)
+{
+	GList *item;
+	GList *known;
+	struct file *source;
+	struct file *other;
+
+	for (item = g_list_first(file->delta_sources); item; item = g_list_next(item)) {
+		source = item->data;
+		for (known = g_list_first(delta->sources); known; known = g_list_next(known)) {
+			other = known->data;
+			if (other->last_change == source->last_change && hash_compare(other->hash, source->hash)) {
+				break;
+			}
+		}
+		if (!known) {
+			delta->sources = g_list_append(delta->sources, source);
+		}
+	}
 }
 
-static GList *consolidate_packs_delta_files(GList *files, struct packdata *pack)
+/* "seen" maps the name of the peer delta of each file to its struct
+ * pack_delta, which it owns, so each file and peer is only listed once
+ * however many packs need it */
+static GList *consolidate_packs_delta_files(GList *files, GHashTable *seen, struct packdata *pack)
 {
+	GHashTable *basenames = NULL;
+	unsigned long long source_format;
 	GList *item;
 	struct file *file;
-	char *from;
-	struct stat stat_delta;
-	int ret;
+	struct pack_delta *delta;
+	char *name;
 
 	if (!pack->end_manifest) {
 		return files;
 	}
 
+	source_format = config_delta_source_format();
+	if (source_format > 0 && pack->end_manifest->format >= source_format) {
+		basenames = index_basenames(pack->from_manifest);
+	}
+
 	item = g_list_first(pack->end_manifest->files);
 
 	while (item) {
@@ -261,38 +417,56 @@ static GList *consolidate_packs_delta_files(GList *files, struct packdata *pack)
 			continue;
 		}
 
-		string_or_die(&from, "%s/%i/delta/%i-%i-%s-%s", staging_dir, file->last_change,
-			      file->peer->last_change, file->last_change, file->peer->hash, file->hash);
+		string_or_die(&name, "%i-%i-%s-%s", file->peer->last_change,
+			      file->last_change, file->peer->hash, file->hash);
+		delta = g_hash_table_lookup(seen, name);
+		if (delta) {
+			LOG(NULL, "Found a duplicate delta", "%d %d %s %s", file->peer->last_change, file->last_change, file->hash, file->filename);
+			free(name);
+		} else {
+			delta = calloc(1, sizeof(struct pack_delta));
+			if (delta == NULL) {
+				assert(0);
+			}
+			delta->file = file;
+			g_hash_table_insert(seen, name, delta);
+		}
 
-		/* check for existence */
-		ret = stat(from, &stat_delta);
-		/* only add if delta does not already exist and the file is not
-		 * in files */
-		if (ret && !find_file_in_list(files, file)) {
-			files = g_list_prepend(files, file);
+		/* make_final_pack picks from this pack's sources, the work
+		 * covers those of every pack */
+		if (basenames && file->is_file && file->peer->is_file) {
+			collect_delta_sources(file, pack, basenames);
+			merge_delta_sources(delta, file);
 		}
 
-		free(from);
+		/* only add if a delta does not already exist */
+		if (!delta->queued && deltas_missing(delta)) {
+			files = g_list_prepend(files, delta);
+			delta->queued = true;
+		}
 	}
 
+	if (basenames) {
+		g_hash_table_destroy(basenames);
+	}
 	return files;
 }
 
 static void create_delta(gpointer data, __unused__ gpointer user_data)
 {
-	struct file *file = data;
+	struct pack_delta *delta = data;
 
 	/* if the file was not found in the from version, skip delta creation */
-	if (file->peer) {
-		__create_delta(file, file->peer->last_change, file->peer->hash);
+	if (delta->file->peer) {
+		create_deltas(delta->file, delta->sources);
 	}
 }
 
-static void make_pack_deltas(GList *files)
+static void make_pack_deltas(GList *deltas)
 {
 	GThreadPool *threadpool;
 	GList *item;
-	struct file *file;
+	struct pack_delta *delta;
 	int ret;
 	GError *err = NULL;
 	int numthreads = num_threads(1.0);
@@ -301,12 +475,12 @@ static void make_pack_deltas(GList *files)
 	threadpool = g_thread_pool_new(create_delta, NULL,
 				       numthreads, FALSE, NULL);
 
-	item = g_list_first(files);
+	item = g_list_first(deltas);
 	while (item) {
-		file = item->data;
+		delta = item->data;
 		item = g_list_next(item);
 
-		ret = g_thread_pool_push(threadpool, file, &err);
+		ret = g_thread_pool_push(threadpool, delta, &err);
 		if (ret == FALSE) {
 			// intentionally non-fatal
 			fprintf(stderr, "GThread create_delta push error\n");
@@ -316,6 +490,43 @@ static void make_pack_deltas(GList *files)
 	}
 
 	g_thread_pool_free(threadpool, FALSE, TRUE);
+	print_delta_prediction_statistics();
+}
+
+/* The source of the smallest delta made for "file", the peer unless a
+ * delta from one of the other candidate sources beats it */
+static struct file *smallest_delta_source(struct file *file)
+{
+	struct file *best = file->peer;
+	struct file *source;
+	struct stat st;
+	off_t best_size = LONG_MAX;
+	char *dir, *path;
+	GList *item;
+
+	if (!file->delta_sources) {
+		return best;
+	}
+
+	dir = delta_dir(staging_dir, file->last_change, file->hash);
+	string_or_die(&path, "%s/%i-%i-%s-%s", dir, best->last_change, file->last_change, best->hash, file->hash);
+	if (stat(path, &st) == 0 && st.st_size > 8) {
+		best_size = st.st_size;
+	}
+	free(path);
+
+	for (item = g_list_first(file->delta_sources); item; item = g_list_next(item)) {
+		source = item->data;
+		string_or_die(&path, "%s/%i-%i-%s-%s", dir, source->last_change, file->last_change, source->hash, file->hash);
+		if (stat(path, &st) == 0 && st.st_size > 8 && st.st_size < best_size) {
+			best = source;
+			best_size = st.st_size;
+		}
+		free(path);
+	}
+	free(dir);
+
+	return best;
 }
 
 /* Returns 0 == success, other == failure */
@@ -325,6 +536,7 @@ static int make_final_pack(struct packdata *pack)
 	struct file *file;
 	int ret;
 	char *param1, *param2;
+	struct file *source;
 	double penalty;
 
 	LOG(NULL, "make_final_pack", "%s: %i to %i", pack->module, pack->from, pack->to);
@@ -332,7 +544,7 @@ static int make_final_pack(struct packdata *pack)
 	item = g_list_first(pack->end_manifest->files);
 
 	while (item) {
-		char *from, *to, *tarfrom, *tarto, *fullfrom, *fullto;
+		char *from, *to, *tarfrom, *tarto, *fullfrom, *fullto, *dir;
 		struct stat stat_delta, stat_tar;
 
 		file = item->data;
@@ -346,13 +558,17 @@ static int make_final_pack(struct packdata *pack)
 
 		/* for each file changed since <X> */
 		/* locate delta, check if the diff it's from is >= <X> */
-		string_or_die(&from, "%s/%i/delta/%i-%i-%s-%s", staging_dir, file->last_change,
-			      file->peer->last_change, file->last_change, file->peer->hash, file->hash);
+		source = smallest_delta_source(file);
+		dir = delta_dir(staging_dir, file->last_change, file->hash);
+		string_or_die(&from, "%s/%i-%i-%s-%s", dir, source->last_change,
+			      file->last_change, source->hash, file->hash);
+		free(dir);
 		string_or_die(&to, "%s/%s/%i_to_%i/delta/%i-%i-%s-%s", packstage_dir,
-			      pack->module, pack->from, pack->to, file->peer->last_change,
-			      file->last_change, file->peer->hash, file->hash);
-		string_or_die(&tarfrom, "%s/%i/files/%s.tar", staging_dir,
-			      file->last_change, file->hash);
+			      pack->module, pack->from, pack->to, source->last_change,
+			      file->last_change, source->hash, file->hash);
+		dir = fullfile_dir(staging_dir, file->last_change, file->hash);
+		string_or_die(&tarfrom, "%s/%s.tar", dir, file->hash);
+		free(dir);
 		string_or_die(&tarto, "%s/%s/%i_to_%i/staged/%s.tar", packstage_dir,
 			      pack->module, pack->from, pack->to, file->hash);
 		string_or_die(&fullfrom, "%s/%i/full/%s", image_dir, file->last_change, file->filename);
@@ -382,7 +598,7 @@ static int make_final_pack(struct packdata *pack)
 		/* delta files get a 5% penalty, they are more cpu work on the client */
 		if ((penalty < (double)(stat_tar.st_size)) || stat_tar.st_size == 0) {
 			/* include delta file in pack */
-			ret = link(from, to);
+			ret = link_or_copy(from, to);
 			if (ret) {
 				if (errno != EEXIST) {
 					LOG(NULL, "Failure to link", "%s to %s (%s) %i\n", from, to, strerror(errno), errno);
@@ -397,14 +613,14 @@ static int make_final_pack(struct packdata *pack)
 			 * versions if the hardlink fails.
 			 */
 			if (!file->is_dir) {
-				ret = link(fullfrom, fullto);
+				ret = link_or_copy(fullfrom, fullto);
 				if (ret && errno != EEXIST) {
 					LOG(NULL, "Failure to link for final pack", "%s to %s (%s) %i\n", fullfrom, fullto, strerror(errno), errno);
 				}
 			}
 
 			if (ret) {
-				ret = link(tarfrom, tarto);
+				ret = link_or_copy(tarfrom, tarto);
 				if (ret && errno != EEXIST) {
 					LOG(NULL, "Failure to link for final pack", "%s to %s (%s) %i\n", tarfrom, tarto, strerror(errno), errno);
 				}
@@ -447,7 +663,7 @@ static int make_final_pack(struct packdata *pack)
 		string_or_die(&to, "%s/%s/%i_to_%i/Manifest-%s-delta-from-%i", packstage_dir,
 			      pack->module, pack->from, pack->to, pack->module, pack->from);
 
-		ret = link(from, to);
+		ret = link_or_copy(from, to);
 		if (ret) {
 			LOG(NULL, "Failed to link", "Manifest-%s-delta-from-%i (%s)", pack->module, pack->from, strerror(errno));
 		} else {
@@ -476,7 +692,7 @@ static int make_final_pack(struct packdata *pack)
 		string_or_die(&to, "%s/%s/%i_to_%i/Manifest-%s-delta-from-%i", packstage_dir,
 			      pack->module, pack->from, pack->to, "MoM", pack->from);
 
-		ret = link(from, to);
+		ret = link_or_copy(from, to);
 		if (ret) {
 			LOG(NULL, "Failed to link", "Manifest-MoM-delta-from-%i (%s)", pack->from, strerror(errno));
 		} else {
@@ -491,8 +707,16 @@ static int make_final_pack(struct packdata *pack)
 	LOG(NULL, "starting tar for pack", "%s: %i to %i", pack->module, pack->from, pack->to);
 	string_or_die(&param1, "%s/%s/%i_to_%i/", packstage_dir, pack->module, pack->from, pack->to);
 	string_or_die(&param2, "%s/%i/pack-%s-from-%i.tar", staging_dir, pack->to, pack->module, pack->from);
-	char *const tarcmd[] = { TAR_COMMAND, "-C", param1, TAR_PERM_ATTR_ARGS_STRLIST, "--numeric-owner", "-Jcf", param2, "delta", "staged", bundle_delta, mom_delta, NULL };
-	ret = system_argv(tarcmd);
+#ifdef SWUPD_WITH_ZSTD
+	if (compression_enabled(COMPRESSION_ZSTD, pack->end_manifest->format)) {
+		char *const tarcmd[] = { TAR_COMMAND, "-C", param1, TAR_PERM_ATTR_ARGS_STRLIST, "--numeric-owner", "-I", ZSTD_COMMAND, "-cf", param2, "delta", "staged", bundle_delta, mom_delta, NULL };
+		ret = system_argv(tarcmd);
+	} else
+#endif
+	{
+		char *const tarcmd[] = { TAR_COMMAND, "-C", param1, TAR_PERM_ATTR_ARGS_STRLIST, "--numeric-owner", "-Jcf", param2, "delta", "staged", bundle_delta, mom_delta, NULL };
+		ret = system_argv(tarcmd);
+	}
 	free(param1);
 	free(param2);
 	LOG(NULL, "finished tar for pack", "%s: %i to %i", pack->module, pack->from, pack->to);
@@ -500,10 +724,16 @@ static int make_final_pack(struct packdata *pack)
 	if ((ret != 0) && (ret != 1)) {
 		fprintf(stderr, "Unexpected return value (%d) creating tar of pack %s from %i to %i\n",
 			ret, pack->module, pack->from, pack->to);
+		ret = -1;
+	} else {
+		ret = 0;
 	}
 
 	/* and clean up */
 	free_manifest(pack->end_manifest);
+	pack->end_manifest = NULL;
+	free_manifest(pack->from_manifest);
+	pack->from_manifest = NULL;
 	empty_pack_stage(1, pack->from, pack->to, pack->module);
 
 	LOG(NULL, "pack complete", "%s: %i to %i", pack->module, pack->from, pack->to);
@@ -514,21 +744,149 @@ static int make_final_pack(struct packdata *pack)
 int make_pack(struct packdata *pack)
 {
 	GList *delta_list = NULL;
+	GHashTable *seen;
 
 	/* step 1: prepare pack */
-	prepare_pack(pack);
+	if (prepare_pack(pack) != 0) {
+		return -1;
+	}
 
 	/* step 2: consolidate delta list & create all delta files*/
-	delta_list = consolidate_packs_delta_files(delta_list, pack);
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, free_pack_delta);
+	delta_list = consolidate_packs_delta_files(delta_list, seen, pack);
 	make_pack_deltas(delta_list);
 	g_list_free(delta_list);
+	g_hash_table_destroy(seen);
 
 	/* step 3: complete pack creation */
 	if (!pack->end_manifest) {
 		return 0;
 	}
 	make_pack_full_files(pack);
-	make_final_pack(pack);
 
+	return make_final_pack(pack);
+}
+
+/* make_packs() runs deltas and pack tarring as tasks of one pool; a task
+ * with delta work makes those deltas, one without finishes its pack */
+struct pack_task {
+	struct pack_delta *delta;
+	struct packdata *pack;
+};
+
+static GMutex pack_task_lock;
+static GCond pack_task_cond;
+static int pack_tasks_pending;
+static int pack_failures;
+
+static void run_pack_task(gpointer data, __unused__ gpointer user_data)
+{
+	struct pack_task *task = data;
+
+	if (task->delta) {
+		create_delta(task->delta, NULL);
+	} else {
+		make_pack_full_files(task->pack);
+		if (make_final_pack(task->pack) != 0) {
+			g_atomic_int_inc(&pack_failures);
+		}
+	}
+	free(task);
+
+	g_mutex_lock(&pack_task_lock);
+	pack_tasks_pending--;
+	g_cond_broadcast(&pack_task_cond);
+	g_mutex_unlock(&pack_task_lock);
+}
+
+static void push_pack_task(GThreadPool *threadpool, struct pack_delta *delta, struct packdata *pack)
+{
+	struct pack_task *task;
+	GError *err = NULL;
+
+	task = calloc(1, sizeof(struct pack_task));
+	if (task == NULL) {
+		assert(0);
+	}
+	task->delta = delta;
+	task->pack = pack;
+
+	g_mutex_lock(&pack_task_lock);
+	pack_tasks_pending++;
+	g_mutex_unlock(&pack_task_lock);
+
+	if (!g_thread_pool_push(threadpool, task, &err)) {
+		fprintf(stderr, "GThread pack task push error\n");
+		fprintf(stderr, "%s\n", err->message);
+		assert(0);
+	}
+}
+
+static void wait_pack_tasks(void)
+{
+	g_mutex_lock(&pack_task_lock);
+	while (pack_tasks_pending > 0) {
+		g_cond_wait(&pack_task_cond, &pack_task_lock);
+	}
+	g_mutex_unlock(&pack_task_lock);
+}
+
+/* Make a set of packs in one go. Unlike running make_pack() once per pack,
+ * a delta needed by several packs (of other bundles, or from other
+ * versions) is only made once, and all the work shares a single pool sized
+ * to the machine. Manifests are still read per pack, since matching
+ * annotates their entries for that pack. The remaining packs are made when
+ * one fails. Returns 0 == success, -1 == failure */
+int make_packs(GList *packs)
+{
+	GThreadPool *threadpool;
+	GList *delta_list = NULL;
+	GHashTable *seen;
+	GList *item;
+	struct packdata *pack;
+	int numthreads = num_threads(1.0);
+	int count = 0;
+
+	pack_failures = 0;
+
+	/* step 1: prepare all packs and collect the union of their deltas */
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, free_pack_delta);
+	for (item = g_list_first(packs); item; item = g_list_next(item)) {
+		pack = item->data;
+		if (prepare_pack(pack) != 0) {
+			pack_failures++;
+			continue;
+		}
+		delta_list = consolidate_packs_delta_files(delta_list, seen, pack);
+	}
+
+	LOG(NULL, "packs threadpool", "%d threads, %d packs, %d deltas",
+	    numthreads, g_list_length(packs), g_list_length(delta_list));
+	threadpool = g_thread_pool_new(run_pack_task, NULL, numthreads, FALSE, NULL);
+
+	/* step 2: every pack may need any of the deltas */
+	for (item = g_list_first(delta_list); item; item = g_list_next(item)) {
+		push_pack_task(threadpool, item->data, NULL);
+	}
+	wait_pack_tasks();
+	g_list_free(delta_list);
+	g_hash_table_destroy(seen);
+	print_delta_prediction_statistics();
+
+	/* step 3: complete pack creation */
+	for (item = g_list_first(packs); item; item = g_list_next(item)) {
+		pack = item->data;
+		if (pack->end_manifest) {
+			push_pack_task(threadpool, NULL, pack);
+			count++;
+		}
+	}
+	printf("Waiting for %i packs to be created\n", count);
+	g_thread_pool_free(threadpool, FALSE, TRUE);
+
+	if (pack_failures > 0) {
+		LOG(NULL, "Pack creation failed", "%i packs", pack_failures);
+		return -1;
+	}
 	return 0;
 }
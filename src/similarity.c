@@ -0,0 +1,289 @@
+/*
+ *   Software Updater - server side
+ *
+ *      Copyright © 2016 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Delta benefit prediction.
+ *
+ * bsdiff needs a suffix sort of the old file, so it costs far more than
+ * reading both files. Whatever part of the new file cannot be found in the
+ * old one ends up in the delta's extra block, so when the files share
+ * (almost) nothing the delta cannot beat the fullfile. This is estimated by
+ * fingerprinting every WINDOW byte window of both files with a rolling hash
+ * and keeping a content-defined sample of the fingerprints; the share of
+ * the new file's distinct samples that also occur in the old file estimates
+ * how much of the new file the delta can copy.
+ *
+ * Exact windows undercount the approximate matches bsdiff finds in code
+ * with relocated addresses, so the threshold is low; compressed data has no
+ * approximate matches and needs twice the configured share.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "swupd.h"
+
+#define WINDOW 16
+#define ROLL_BASE 0x100000001b3ULL
+/* samples taken from a file of up to this size; larger files are sampled
+ * more sparsely so the fingerprint sets stay small */
+#define TARGET_SAMPLES 16384
+#define MIN_SAMPLE_RATE 64
+/* below this many samples of the new file nothing can be told */
+#define MIN_SAMPLES 16
+/* an old file this many times smaller cannot contribute enough */
+#define SIZE_RATIO 64
+
+static int hopeless_count;
+
+struct fingerprints {
+	uint64_t *samples;
+	size_t count;
+	size_t allocated;
+};
+
+/* finalizer of splitmix64, so the sampling does not depend on the low
+ * bits of the polynomial hash alone */
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static void add_sample(struct fingerprints *fp, uint64_t sample)
+{
+	if (fp->count == fp->allocated) {
+		fp->allocated = fp->allocated ? fp->allocated * 2 : 1024;
+		fp->samples = realloc(fp->samples, fp->allocated * sizeof(uint64_t));
+		if (!fp->samples) {
+			assert(0);
+		}
+	}
+	fp->samples[fp->count++] = sample;
+}
+
+/* sample the fingerprints of every WINDOW byte window of "data" whose mixed
+ * hash is a multiple of "rate" (a power of two) */
+static void fingerprint(const unsigned char *data, size_t len, uint64_t rate, struct fingerprints *fp)
+{
+	uint64_t h = 0;
+	uint64_t out = 1; /* ROLL_BASE^WINDOW, the weight of the byte leaving */
+	uint64_t m;
+	size_t i;
+
+	if (len < WINDOW) {
+		return;
+	}
+
+	for (i = 0; i < WINDOW; i++) {
+		out *= ROLL_BASE;
+	}
+
+	for (i = 0; i < len; i++) {
+		h = h * ROLL_BASE + data[i];
+		if (i >= WINDOW) {
+			h -= out * data[i - WINDOW];
+		}
+		if (i + 1 < WINDOW) {
+			continue;
+		}
+		m = mix(h);
+		if ((m & (rate - 1)) == 0) {
+			add_sample(fp, m);
+		}
+	}
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sort and drop repeated samples, so padding and other repeated content
+ * is only counted once */
+static void unique_samples(struct fingerprints *fp)
+{
+	size_t i, count = 0;
+
+	qsort(fp->samples, fp->count, sizeof(uint64_t), compare_samples);
+	for (i = 0; i < fp->count; i++) {
+		if (count == 0 || fp->samples[i] != fp->samples[count - 1]) {
+			fp->samples[count++] = fp->samples[i];
+		}
+	}
+	fp->count = count;
+}
+
+static void *map_file(const char *filename, size_t len)
+{
+	void *data;
+	int fd;
+
+	if (len == 0) {
+		return NULL;
+	}
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	return data;
+}
+
+/* Estimate which share (in percent) of the new file can be found in the
+ * old one; -1 when the files are too small or unreadable to tell */
+static int estimate_similarity(const char *original, const char *newfile,
+			       uint64_t old_size, uint64_t new_size, bool *compressed)
+{
+	struct fingerprints old_fp = { 0 }, new_fp = { 0 };
+	unsigned char *old_data, *new_data;
+	uint64_t rate = MIN_SAMPLE_RATE;
+	size_t found = 0;
+	size_t i;
+	int ret = -1;
+
+	*compressed = false;
+	while ((old_size > new_size ? old_size : new_size) / rate > TARGET_SAMPLES) {
+		rate *= 2;
+	}
+
+	old_data = map_file(original, old_size);
+	new_data = map_file(newfile, new_size);
+	if (!old_data || !new_data) {
+		goto out;
+	}
+
+	*compressed = data_is_compressed(new_data, new_size);
+	fingerprint(new_data, new_size, rate, &new_fp);
+	if (new_fp.count < MIN_SAMPLES) {
+		goto out;
+	}
+	fingerprint(old_data, old_size, rate, &old_fp);
+
+	qsort(old_fp.samples, old_fp.count, sizeof(uint64_t), compare_samples);
+	unique_samples(&new_fp);
+	if (new_fp.count < MIN_SAMPLES) {
+		goto out;
+	}
+	for (i = 0; i < new_fp.count; i++) {
+		if (old_fp.count &&
+		    bsearch(&new_fp.samples[i], old_fp.samples, old_fp.count, sizeof(uint64_t), compare_samples)) {
+			found++;
+		}
+	}
+	ret = found * 100 / new_fp.count;
+
+out:
+	if (old_data) {
+		munmap(old_data, old_size);
+	}
+	if (new_data) {
+		munmap(new_data, new_size);
+	}
+	free(old_fp.samples);
+	free(new_fp.samples);
+	return ret;
+}
+
+/* Estimate how much of "newfile" a delta from "original" can copy */
+void estimate_delta(const char *original, const char *newfile, struct delta_estimate *estimate)
+{
+	struct stat old_stat, new_stat;
+
+	estimate->similarity = -1;
+	estimate->compressed = false;
+	if (lstat(original, &old_stat) != 0 || lstat(newfile, &new_stat) != 0 ||
+	    !S_ISREG(old_stat.st_mode) || !S_ISREG(new_stat.st_mode)) {
+		return;
+	}
+	if ((uint64_t)old_stat.st_size * SIZE_RATIO < (uint64_t)new_stat.st_size) {
+		estimate->similarity = 0;
+		return;
+	}
+	estimate->similarity = estimate_similarity(original, newfile, old_stat.st_size, new_stat.st_size,
+						   &estimate->compressed);
+}
+
+/* Predict whether a delta between the two files can beat the fullfile,
+ * from "known" when the caller already estimated the pair. Returns whether
+ * bsdiff should be run; "predicted" receives the prediction itself, which
+ * differs when a hopeless pair is audited. */
+bool delta_worth_trying(struct file *file, const char *original, const char *newfile,
+			const struct delta_estimate *known, bool *predicted)
+{
+	struct delta_estimate estimate;
+	int threshold = config_delta_similarity();
+	int audit = config_delta_audit();
+	int similarity;
+	bool compressed;
+
+	*predicted = true;
+	if (threshold <= 0) {
+		return true;
+	}
+
+	if (known) {
+		estimate = *known;
+	} else {
+		estimate_delta(original, newfile, &estimate);
+	}
+	similarity = estimate.similarity;
+	compressed = estimate.compressed;
+	if (similarity < 0) {
+		return true;
+	}
+	if (compressed) {
+		threshold *= 2;
+	}
+	if (similarity >= threshold) {
+		return true;
+	}
+
+	*predicted = false;
+	if (audit > 0 && g_atomic_int_add(&hopeless_count, 1) % audit == 0) {
+		LOG(file, "Auditing hopeless delta", "%s: %i%% similar%s", file->hash,
+		    similarity, compressed ? ", compressed" : "");
+		return true;
+	}
+	LOG(file, "Skipping hopeless delta", "%s: %i%% similar%s", file->hash,
+	    similarity, compressed ? ", compressed" : "");
+	account_delta_skipped();
+	return false;
+}
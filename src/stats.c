@@ -29,6 +29,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "archive.h"
 #include "swupd.h"
 
 static int new_files;
@@ -37,6 +38,24 @@ static int changed_files;
 static int delta_miss;
 static int delta_hit;
 
+/* fullfile compression selection, updated from the fullfile threads */
+static int compressed_files[FILE_CLASS_TYPES];
+static int compressions[FILE_CLASS_TYPES];
+static int compression_wins[COMPRESSION_TYPES];
+static int predictions_checked[FILE_CLASS_TYPES];
+static int predictions_correct[FILE_CLASS_TYPES];
+/* input bytes fed to the real and to the trial compressions */
+static GMutex compression_bytes_lock;
+static uint64_t compressed_bytes;
+static uint64_t compressed_input_bytes;
+static int trials;
+static uint64_t trial_bytes;
+
+/* delta benefit prediction, updated from the delta threads; indexed by
+ * [predicted useful][delta actually beat the fullfile] */
+static int delta_skipped;
+static int delta_outcomes[2][2];
+
 void account_new_file(void)
 {
 	new_files++;
@@ -92,3 +111,95 @@ void print_delta_statistics(void)
 {
 	LOG(NULL, "Delta stats", "%i successful delta usages, %i failures", delta_hit, delta_miss);
 }
+
+void account_compression_choice(int class, int count, int winner, uint64_t size)
+{
+	g_atomic_int_inc(&compressed_files[class]);
+	g_atomic_int_add(&compressions[class], count);
+	g_atomic_int_inc(&compression_wins[winner]);
+	g_mutex_lock(&compression_bytes_lock);
+	compressed_bytes += size;
+	compressed_input_bytes += size * count;
+	g_mutex_unlock(&compression_bytes_lock);
+}
+
+void account_compression_trial(uint64_t size)
+{
+	g_mutex_lock(&compression_bytes_lock);
+	trials++;
+	trial_bytes += size;
+	g_mutex_unlock(&compression_bytes_lock);
+}
+
+void account_compression_prediction(int class, bool correct)
+{
+	g_atomic_int_inc(&predictions_checked[class]);
+	if (correct) {
+		g_atomic_int_inc(&predictions_correct[class]);
+	}
+}
+
+/* "format" is that of the version, which decides how many compressions
+ * every file would have had without prediction. The saving is counted in
+ * input bytes, so the trial compressions are paid out of it. */
+void print_compression_statistics(unsigned long long format)
+{
+	int files = 0, total = 0, checked = 0, correct = 0;
+	int enabled = 0;
+	int64_t saved;
+	int i;
+
+	for (i = 0; i < FILE_CLASS_TYPES; i++) {
+		if (compressed_files[i] == 0) {
+			continue;
+		}
+		LOG(NULL, "Compression stats", "%s: %i files, %i compressions, prediction %i/%i correct",
+		    file_class_name(i), compressed_files[i], compressions[i],
+		    predictions_correct[i], predictions_checked[i]);
+		files += compressed_files[i];
+		total += compressions[i];
+		checked += predictions_checked[i];
+		correct += predictions_correct[i];
+	}
+	for (i = 0; i < COMPRESSION_TYPES; i++) {
+		if (compression_enabled(i, format)) {
+			enabled++;
+			LOG(NULL, "Compression stats", "%s chosen for %i files", compression_suffix(i), compression_wins[i]);
+		}
+	}
+	if (files == 0) {
+		return;
+	}
+	saved = (int64_t)(compressed_bytes * enabled) - (int64_t)compressed_input_bytes - (int64_t)trial_bytes;
+	printf("Compressed %i fullfiles with %i compressions and %i trials (%lld KiB less input than all types)\n",
+	       files, total, trials, (long long)saved / 1024);
+	if (checked > 0) {
+		printf("Compression prediction correct for %i of %i checked files\n", correct, checked);
+	}
+}
+
+void account_delta_skipped(void)
+{
+	g_atomic_int_inc(&delta_skipped);
+}
+
+void account_delta_prediction(bool predicted, bool actual)
+{
+	g_atomic_int_inc(&delta_outcomes[predicted][actual]);
+}
+
+void print_delta_prediction_statistics(void)
+{
+	LOG(NULL, "Delta prediction stats", "%i skipped; predicted useful: %i won, %i lost; audited hopeless: %i won, %i lost",
+	    delta_skipped, delta_outcomes[1][1], delta_outcomes[1][0], delta_outcomes[0][1], delta_outcomes[0][0]);
+	if (delta_skipped + delta_outcomes[1][1] + delta_outcomes[1][0] == 0) {
+		return;
+	}
+	printf("Skipped %i hopeless deltas; %i of %i tried deltas beat the fullfile",
+	       delta_skipped, delta_outcomes[1][1], delta_outcomes[1][1] + delta_outcomes[1][0]);
+	if (delta_outcomes[0][1] + delta_outcomes[0][0] > 0) {
+		printf(", %i of %i audited skips would have", delta_outcomes[0][1],
+		       delta_outcomes[0][1] + delta_outcomes[0][0]);
+	}
+	printf("\n");
+}
@@ -267,3 +267,56 @@ int xattrs_compare(const char *filename1, const char *filename2)
 
 	return ret;
 }
+
+void xattrs_for_each(const char *filename, xattrs_callback_t callback, void *data)
+{
+	ssize_t len;
+	char *list;
+	char *value;
+	const char **sorted_list;
+	int count;
+	int i;
+
+	len = llistxattr(filename, NULL, 0);
+	if (len <= 0) {
+		return; // no xattrs, this is OK
+	}
+
+	list = calloc(1, len);
+	assert(list);
+
+	len = llistxattr(filename, list, len);
+	if (len <= 0) {
+		free(list);
+		return; // no xattrs, this is OK
+	}
+
+	count = get_xattr_name_count(list, len);
+	sorted_list = get_sorted_xattr_name_table(list, count);
+
+	for (i = 0; i < count; i++) {
+		len = lgetxattr(filename, sorted_list[i], NULL, 0);
+		if (len < 0) {
+			LOG(NULL, "Failed to get x-attribute length",
+			    "%s for file %s: %s",
+			    sorted_list[i], filename, strerror(errno));
+			continue;
+		}
+
+		value = calloc(1, len + 1);
+		assert(value);
+
+		len = lgetxattr(filename, sorted_list[i], value, len);
+		if (len < 0) {
+			LOG(NULL, "Failed to get x-attribute",
+			    "%s for file %s: %s",
+			    sorted_list[i], filename, strerror(errno));
+		} else {
+			callback(sorted_list[i], value, len, data);
+		}
+		free(value);
+	}
+
+	free(list);
+	free(sorted_list);
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  sed -i "s|^engine=.*|engine=xdelta|" $DIR/server.ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+
+  gen_file_to_delta 10 4096 20 4 test-bundle randomfile
+}
+
+make_delta() {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+  sudo $MAKE_PACK --statedir $DIR 10 20 test-bundle
+
+  old=$(hash_for 10 test-bundle /randomfile)
+  new=$(hash_for 20 test-bundle /randomfile)
+  delta=$DIR/www/20/delta/10-20-$old-$new
+  [ -s $delta ]
+}
+
+@test "the configured engine makes deltas from engineformat on" {
+  if ! command -v xdelta3 > /dev/null; then
+    skip "xdelta3 not installed"
+  fi
+  sed -i "s|^engineformat=.*|engineformat=3|" $DIR/server.ini
+  make_delta
+
+  # a VCDIFF stream, stored apart from bsdiff deltas of the same pair
+  [ "$(head -c 3 $delta | od -An -tx1 | tr -d ' ')" = "d6c3c4" ]
+  [ -s "$DIR/objects/delta/${new:0:2}/$old-$new.xdelta" ]
+}
+
+@test "older formats keep bsdiff deltas" {
+  sed -i "s|^engineformat=.*|engineformat=4|" $DIR/server.ini
+  make_delta
+
+  [ "$(head -c 3 $delta | od -An -tx1 | tr -d ' ')" != "d6c3c4" ]
+  [ -s "$DIR/objects/delta/${new:0:2}/$old-$new" ]
+}
+
+@test "a mode change gets a metadata record" {
+  sed -i "s|^engineformat=.*|engineformat=3|" $DIR/server.ini
+  cp -a $DIR/image/10/test-bundle/randomfile $DIR/image/20/test-bundle/randomfile
+  chmod 0600 $DIR/image/20/test-bundle/randomfile
+  make_delta
+
+  [ "$(head -n 1 $delta)" = "$(printf 'SWUPD-METADATA\t1')" ]
+  grep -q "^mode:	600$" $delta
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
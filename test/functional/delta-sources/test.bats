@@ -0,0 +1,99 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+
+  # the new a/data is the old b/data with a few bytes more, and only half
+  # like the old a/data
+  mkdir -p $DIR/image/10/test-bundle/a $DIR/image/10/test-bundle/b
+  mkdir -p $DIR/image/20/test-bundle/a $DIR/image/20/test-bundle/b
+  dd if=/dev/urandom of=$DIR/image/10/test-bundle/b/data bs=1 count=8192
+  head -c 4096 $DIR/image/10/test-bundle/b/data > $DIR/image/10/test-bundle/a/data
+  dd if=/dev/urandom bs=1 count=4096 >> $DIR/image/10/test-bundle/a/data
+  cp $DIR/image/10/test-bundle/b/data $DIR/image/20/test-bundle/b/data
+  dd if=/dev/urandom of=$DIR/image/20/test-bundle/b/data bs=1 count=16 conv=notrunc
+  cat $DIR/image/10/test-bundle/b/data > $DIR/image/20/test-bundle/a/data
+  echo "a few bytes more" >> $DIR/image/20/test-bundle/a/data
+}
+
+make_pack() {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+  sudo $MAKE_PACK --statedir $DIR 10 20 test-bundle
+
+  source=$(hash_for 10 test-bundle /b/data)
+  new=$(hash_for 20 test-bundle /a/data)
+}
+
+@test "a file of the same name can be the delta source" {
+  sed -i "s|^sourceformat=.*|sourceformat=3|" $DIR/server.ini
+  make_pack
+
+  [ -s $DIR/www/20/delta/10-20-$source-$new ]
+  tar -tf $DIR/www/20/pack-test-bundle-from-10.tar | grep -q "delta/10-20-$source-$new"
+}
+
+@test "other sources are tried when the peer delta already exists" {
+  make_pack
+  old=$(hash_for 10 test-bundle /a/data)
+  [ -s $DIR/www/20/delta/10-20-$old-$new ]
+  [ ! -e $DIR/www/20/delta/10-20-$source-$new ]
+
+  sed -i "s|^sourceformat=.*|sourceformat=3|" $DIR/server.ini
+  sudo $MAKE_PACK --statedir $DIR 10 20 test-bundle
+
+  [ -s $DIR/www/20/delta/10-20-$source-$new ]
+}
+
+@test "packs sharing a delta each get the sources of their from manifest" {
+  sed -i "s|^sourceformat=.*|sourceformat=3|" $DIR/server.ini
+
+  # a/data is in both bundles, only test-bundle2 also has b/data
+  init_groups_ini test-bundle2
+  for ver in 10 20; do
+    track_bundle $ver test-bundle2
+    cp -a $DIR/image/$ver/test-bundle/a $DIR/image/$ver/test-bundle2/
+    mv $DIR/image/$ver/test-bundle/b $DIR/image/$ver/test-bundle2/
+  done
+
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+  sudo $MAKE_PACKS --statedir $DIR --from 10 20 test-bundle test-bundle2
+
+  source=$(hash_for 10 test-bundle2 /b/data)
+  new=$(hash_for 20 test-bundle /a/data)
+  [ "$new" = "$(hash_for 20 test-bundle2 /a/data)" ]
+  [ -s $DIR/www/20/delta/10-20-$source-$new ]
+  tar -tf $DIR/www/20/pack-test-bundle2-from-10.tar | grep -q "delta/10-20-$source-$new"
+  ! tar -tf $DIR/www/20/pack-test-bundle-from-10.tar | grep -q "delta/10-20-$source-$new"
+}
+
+@test "older formats only diff against the peer" {
+  sed -i "s|^sourceformat=.*|sourceformat=4|" $DIR/server.ini
+  make_pack
+
+  [ ! -e $DIR/www/20/delta/10-20-$source-$new ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
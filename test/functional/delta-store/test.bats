@@ -0,0 +1,52 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  for ver in 10 20 30 40; do
+    set_os_release $ver os-core
+    track_bundle $ver os-core
+    track_bundle $ver test-bundle
+  done
+
+  # randomfile flips between the same two contents
+  gen_file_to_delta 10 4096 20 4 test-bundle randomfile
+  copy_file 10 test-bundle randomfile 30 test-bundle randomfile
+  copy_file 20 test-bundle randomfile 40 test-bundle randomfile
+}
+
+@test "deltas between the same two contents are made once" {
+  for ver in 10 20 30 40; do
+    sudo $CREATE_UPDATE --osversion $ver --statedir $DIR --format 3
+    sudo $MAKE_FULLFILES --statedir $DIR $ver
+    set_latest_ver $ver
+  done
+  sudo $MAKE_PACK --statedir $DIR 10 20 test-bundle
+  sudo $MAKE_PACK --statedir $DIR 30 40 test-bundle
+
+  old=$(hash_for 10 test-bundle /randomfile)
+  new=$(hash_for 20 test-bundle /randomfile)
+  [ "$old" = "$(hash_for 30 test-bundle /randomfile)" ]
+  [ "$new" = "$(hash_for 40 test-bundle /randomfile)" ]
+
+  object="$DIR/objects/delta/${new:0:2}/$old-$new"
+  [ -s "$object" ]
+  [ "$(stat -c %i "$object")" = "$(stat -c %i $DIR/www/20/delta/10-20-$old-$new)" ]
+  [ "$(stat -c %i "$object")" = "$(stat -c %i $DIR/www/40/delta/30-40-$old-$new)" ]
+  [[ $(tar -tf $DIR/www/40/pack-test-bundle-from-30.tar | grep "^delta/30-40-$old-$new$") ]]
+
+  # collected once no version refers to it
+  sudo rm -rf $DIR/www/20 $DIR/www/40
+  sudo $GC_OBJECTS --statedir $DIR
+  [ ! -e "$object" ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
@@ -84,6 +84,11 @@ setup() {
   [[ $(tar -tf $DIR/www/20/pack-os-core-from-10.tar | grep '^Manifest-os-core-delta-from-10') ]]
   [[ $(tar -tf $DIR/www/20/pack-os-core-from-10.tar | grep '^Manifest-MoM-delta-from-10') ]]
   [[ $(tar -tf $DIR/www/20/pack-test-bundle-from-10.tar | grep '^Manifest-test-bundle-delta-from-10') ]]
+
+  # and were already made by swupd_create_update, without leftover claims
+  [ -s $DIR/www/20/Manifest-test-bundle-delta-from-10 ]
+  [ -s $DIR/www/20/Manifest-MoM-delta-from-10 ]
+  [[ 0 -eq $(ls -A $DIR/www/20 | grep -c '\.claim$') ]]
 }
 
 # vi: ft=sh ts=8 sw=2 sts=2 et tw=80
@@ -0,0 +1,113 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+# enough small files, changed in every version, to train a dictionary on
+gen_samples() {
+  local ver=$1
+
+  for i in $(seq 1 24); do
+    gen_file_plain_change $ver test-bundle conf/sample$i
+    seq $i $((ver * 7 + i)) >> $DIR/image/$ver/test-bundle/conf/sample$i
+  done
+}
+
+build_version() {
+  local ver=$1
+
+  sudo $CREATE_UPDATE --osversion $ver --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR $ver
+  set_latest_ver $ver
+}
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  sed -i "s|^zstdformat=.*|zstdformat=3|" $DIR/server.ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  for ver in 10 20 30; do
+    set_os_release $ver os-core
+    track_bundle $ver os-core
+    track_bundle $ver test-bundle
+    gen_samples $ver
+  done
+
+  # foo changes in 20 and reverts to its original content in 30
+  gen_file_plain 10 test-bundle foo
+  gen_file_plain_change 20 test-bundle foo
+  gen_file_plain 30 test-bundle foo
+}
+
+@test "make_fullfiles trains and publishes a zstd dictionary" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  run sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ "$status" -eq 0 ]
+  [ -s $DIR/www/10/zstd.dict ] || skip "built without zstd"
+  [[ "$output" =~ "Trained zstd dictionary" ]]
+  [ "$(od -An -tx1 -N4 $DIR/www/10/zstd.dict | tr -d ' ')" = "37a430ec" ]
+
+  # small fullfiles are compressed with it and need it to be unpacked
+  compressed=0
+  for i in $(seq 1 24); do
+    hash=$(hash_for 10 test-bundle /conf/sample$i)
+    tar=$DIR/www/10/files/$hash.tar
+    [ -s $tar ]
+    if [ "$(od -An -tx1 -N4 $tar | tr -d ' ')" != "28b52ffd" ]; then
+      continue
+    fi
+    compressed=$((compressed + 1))
+    if command -v zstd > /dev/null; then
+      ! zstd -dc $tar > /dev/null 2>&1
+      zstd -dc -D $DIR/www/10/zstd.dict $tar | tar -t | grep -q "^$hash$"
+    fi
+  done
+  [ $compressed -gt 0 ]
+}
+
+@test "a resumed run reuses the published dictionary" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ -s $DIR/www/10/zstd.dict ] || skip "built without zstd"
+  cp $DIR/www/10/zstd.dict $DIR/zstd.dict.orig
+
+  hash=$(hash_for 10 test-bundle /conf/sample1)
+  sudo rm $DIR/www/10/files/$hash.tar
+  ls $DIR/www/10/files | sed "s/\.tar$//" | sudo tee $DIR/www/10/.fullfiles.journal > /dev/null
+
+  run sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ "$status" -eq 0 ]
+  [[ "$output" =~ "Reusing zstd dictionary" ]]
+  cmp $DIR/www/10/zstd.dict $DIR/zstd.dict.orig
+  [ -s $DIR/www/10/files/$hash.tar ]
+}
+
+@test "no dictionary when the format does not allow zstd" {
+  sed -i "s|^zstdformat=.*|zstdformat=4|" $DIR/server.ini
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ ! -e $DIR/www/10/zstd.dict ]
+}
+
+@test "small fullfiles are not shared across dictionaries" {
+  build_version 10
+  [ -s $DIR/www/10/zstd.dict ] || skip "built without zstd"
+  build_version 20
+  build_version 30
+  [ -s $DIR/www/30/zstd.dict ]
+  ! cmp -s $DIR/www/10/zstd.dict $DIR/www/30/zstd.dict
+
+  hash=$(hash_for 30 test-bundle /foo)
+  [ "$hash" = "$(hash_for 10 test-bundle /foo)" ]
+
+  # one object per dictionary, none keyed by the bare hash
+  [ 2 -eq $(ls $DIR/objects/${hash:0:2}/ | grep -c "^$hash\.dict-.*\.tar$") ]
+  [ ! -e $DIR/objects/${hash:0:2}/$hash.tar ]
+  [ "$(stat -c %i $DIR/www/10/files/$hash.tar)" != "$(stat -c %i $DIR/www/30/files/$hash.tar)" ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
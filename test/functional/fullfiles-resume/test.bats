@@ -0,0 +1,54 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+
+  gen_file_plain 10 test-bundle foo
+}
+
+@test "make_fullfiles resumes from its journal" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+
+  hash=$(hash_for 10 test-bundle /foo)
+  journal="$DIR/www/10/.fullfiles.journal"
+  [ ! -e "$journal" ]
+
+  # simulate a run interrupted while foo was being compressed: everything
+  # else is journaled
+  sudo rm $DIR/www/10/files/$hash.tar
+  ls $DIR/www/10/files | sed "s/\.tar$//" | sudo tee "$journal" > /dev/null
+  sudo touch $DIR/www/10/files/.$hash.tar.xz
+
+  run sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ "$status" -eq 0 ]
+  [[ "$output" =~ "queued 1 full file creations" ]]
+  [ -s $DIR/www/10/files/$hash.tar ]
+  [ ! -e $DIR/www/10/files/.$hash.tar.xz ]
+  [ ! -e "$journal" ]
+}
+
+@test "a rerun after a completed run recreates removed fullfiles" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+
+  hash=$(hash_for 10 test-bundle /foo)
+  sudo rm $DIR/www/10/files/$hash.tar
+
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  [ -s $DIR/www/10/files/$hash.tar ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
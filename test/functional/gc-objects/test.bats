@@ -0,0 +1,62 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+  set_os_release 30 os-core
+  track_bundle 30 os-core
+  track_bundle 30 test-bundle
+
+  # foo changes in 20 and reverts to its original content in 30
+  gen_file_plain 10 test-bundle foo
+  gen_file_plain_change 20 test-bundle foo
+  gen_file_plain 30 test-bundle foo
+}
+
+@test "fullfiles are shared through the object store and collected" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+  set_latest_ver 20
+  sudo $CREATE_UPDATE --osversion 30 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 30
+
+  hash=$(hash_for 30 test-bundle /foo)
+  [ "$hash" = "$(hash_for 10 test-bundle /foo)" ]
+  object="$DIR/objects/${hash:0:2}/$hash.tar"
+
+  # the reverted content is the very same object as in version 10
+  [ -s "$object" ]
+  [ "$(stat -c %i "$object")" = "$(stat -c %i $DIR/www/10/files/$hash.tar)" ]
+  [ "$(stat -c %i "$object")" = "$(stat -c %i $DIR/www/30/files/$hash.tar)" ]
+
+  # still referenced from version 30
+  sudo rm -rf $DIR/www/10
+  sudo $GC_OBJECTS --statedir $DIR
+  [ -s "$object" ]
+
+  # no longer referenced
+  sudo rm -rf $DIR/www/30
+  sudo $GC_OBJECTS --statedir $DIR --dry-run
+  [ -s "$object" ]
+  sudo $GC_OBJECTS --statedir $DIR
+  [ ! -e "$object" ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
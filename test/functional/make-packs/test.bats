@@ -0,0 +1,67 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+
+  gen_file_to_delta 10 4096 20 4 test-bundle randomfile
+  gen_file_plain 10 test-bundle foo
+  gen_file_plain 20 test-bundle bar
+}
+
+@test "make_packs makes every bundle from every version in one run" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+
+  sudo $MAKE_PACKS --statedir $DIR --from 0 --from 10 20 os-core test-bundle
+
+  [ -s $DIR/www/20/pack-os-core-from-0.tar ]
+  [ -s $DIR/www/20/pack-test-bundle-from-0.tar ]
+  [ -s $DIR/www/20/pack-os-core-from-10.tar ]
+  [ -s $DIR/www/20/pack-test-bundle-from-10.tar ]
+
+  old=$(hash_for 10 test-bundle /randomfile)
+  new=$(hash_for 20 test-bundle /randomfile)
+  [[ $(tar -tf $DIR/www/20/pack-test-bundle-from-10.tar | grep "^delta/10-20-$old-$new$") ]]
+  [[ $(tar -tf $DIR/www/20/pack-os-core-from-10.tar | grep '^Manifest-MoM-delta-from-10') ]]
+}
+
+@test "make_packs fails when one of its packs fails" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+
+  # an unreadable end manifest fails that pack only
+  echo "garbage" | sudo tee $DIR/www/20/Manifest.test-bundle > /dev/null
+
+  run sudo $MAKE_PACKS --statedir $DIR --from 10 20 os-core test-bundle
+  [ "$status" -eq 1 ]
+  [ -s $DIR/www/20/pack-os-core-from-10.tar ]
+  [ ! -e $DIR/www/20/pack-test-bundle-from-10.tar ]
+}
+
+@test "make_packs invalid version combination" {
+  run sudo $MAKE_PACKS --statedir $DIR --from 20 20 os-core
+  [ "$status" -eq 1 ]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
@@ -0,0 +1,46 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  sed -i "s|^manifestformat=.*|manifestformat=3|" $DIR/server.ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+
+  gen_file_plain 10 test-bundle foo
+  gen_file_plain 10 test-bundle bar
+  gen_file_plain 20 test-bundle foo
+  gen_file_plain 20 test-bundle baz
+}
+
+@test "manifest deltas list the changed records" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+
+  for m in test-bundle MoM; do
+    delta=$DIR/www/20/Manifest-$m-delta-from-10
+    [ "$(head -1 $delta)" = "MANIFEST-DELTA	1" ]
+    sudo $APPLY_MANIFEST_DELTA $DIR/www/10/Manifest.$m $delta $DIR/Manifest.$m
+    cmp $DIR/Manifest.$m $DIR/www/20/Manifest.$m
+  done
+
+  # only the deleted bar and the new baz changed
+  [[ 2 -eq $(grep -c '^+	' $DIR/www/20/Manifest-test-bundle-delta-from-10) ]]
+  [[ 1 -eq $(grep -c '^+	[0-9]*	.d..	0*	20	/bar$' $DIR/www/20/Manifest-test-bundle-delta-from-10) ]]
+  [[ 1 -eq $(grep -c '^+	[0-9]*	.*	20	/baz$' $DIR/www/20/Manifest-test-bundle-delta-from-10) ]]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
@@ -0,0 +1,50 @@
+#!/usr/bin/env bats
+
+# common functions
+load "../swupdlib"
+
+setup() {
+  clean_test_dir
+  init_test_dir
+
+  init_server_ini
+  sed -i "s|^shardformat=.*|shardformat=3|" $DIR/server.ini
+  set_latest_ver 0
+  init_groups_ini os-core test-bundle
+
+  set_os_release 10 os-core
+  track_bundle 10 os-core
+  track_bundle 10 test-bundle
+  set_os_release 20 os-core
+  track_bundle 20 os-core
+  track_bundle 20 test-bundle
+
+  gen_file_to_delta 10 4096 20 4 test-bundle randomfile
+  gen_file_plain 10 test-bundle foo
+}
+
+@test "fullfiles and deltas are sharded by hash" {
+  sudo $CREATE_UPDATE --osversion 10 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 10
+  set_latest_ver 10
+  sudo $CREATE_UPDATE --osversion 20 --statedir $DIR --format 3
+  sudo $MAKE_FULLFILES --statedir $DIR 20
+  sudo $MAKE_PACK --statedir $DIR 10 20 test-bundle
+
+  [ -e $DIR/www/10/.sharded ]
+  [ -e $DIR/www/20/.sharded ]
+
+  hash=$(hash_for 10 test-bundle /foo)
+  [ -s $DIR/www/10/files/${hash:0:2}/$hash.tar ]
+  [ ! -e $DIR/www/10/files/$hash.tar ]
+
+  old=$(hash_for 10 test-bundle /randomfile)
+  new=$(hash_for 20 test-bundle /randomfile)
+  [ -s $DIR/www/20/files/${new:0:2}/$new.tar ]
+  [ -s $DIR/www/20/delta/${new:0:2}/10-20-$old-$new ]
+
+  # the pack itself keeps the flat layout clients expect
+  [[ $(tar -tf $DIR/www/20/pack-test-bundle-from-10.tar | grep "^delta/10-20-$old-$new$") ]]
+}
+
+# vi: ft=sh ts=8 sw=2 sts=2 et tw=80
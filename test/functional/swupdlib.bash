@@ -6,6 +6,9 @@ export SRCDIR="$BATS_TEST_DIRNAME/../../../"
 export CREATE_UPDATE="$SRCDIR/swupd_create_update"
 export MAKE_FULLFILES="$SRCDIR/swupd_make_fullfiles"
 export MAKE_PACK="$SRCDIR/swupd_make_pack"
+export MAKE_PACKS="$SRCDIR/swupd_make_packs"
+export GC_OBJECTS="$SRCDIR/swupd_gc_objects"
+export APPLY_MANIFEST_DELTA="$SRCDIR/swupd_apply_manifest_delta"
 
 export DIR="$BATS_TEST_DIRNAME/web-dir"
 